@@ -0,0 +1,130 @@
+#include "BuddyAllocator.hpp"
+#include "kmalloc.hpp"
+#include "kprintf.hpp"
+#include <LibC/string.h>
+#include <LibCore/Defines.hpp>
+
+void BuddyAllocator::initialize(PageFrame *frames, const u32 first_frame,
+                                const size_t count) {
+  memset(frames, 0, count * sizeof(PageFrame));
+  m_frames = frames;
+  m_first_frame = first_frame;
+  m_frame_count = count;
+}
+
+PageFrame *BuddyAllocator::frame(const u32 frame_number) {
+  if (frame_number < m_first_frame ||
+      frame_number - m_first_frame >= m_frame_count)
+    return nullptr;
+  return &m_frames[frame_number - m_first_frame];
+}
+
+PageFrame &BuddyAllocator::frame_for(const PhysicalAddress addr) {
+  PageFrame *frame = this->frame(addr.get() / PAGE_SIZE);
+  ASSERT(frame);
+  return *frame;
+}
+
+u8 BuddyAllocator::order_for(const size_t count) {
+  u8 order = 0;
+  while ((1zu << order) < count)
+    order++;
+  return order;
+}
+
+void BuddyAllocator::insert(PageFrame &frame, const u8 order) {
+  frame.order = order;
+  frame.free_head = true;
+  frame.prev_free = nullptr;
+  frame.next_free = m_free_lists[order];
+  if (m_free_lists[order])
+    m_free_lists[order]->prev_free = &frame;
+  m_free_lists[order] = &frame;
+  m_free_blocks[order]++;
+  m_free_frames += 1zu << order;
+}
+
+void BuddyAllocator::remove(PageFrame &frame) {
+  if (frame.prev_free)
+    frame.prev_free->next_free = frame.next_free;
+  else
+    m_free_lists[frame.order] = frame.next_free;
+  if (frame.next_free)
+    frame.next_free->prev_free = frame.prev_free;
+  frame.free_head = false;
+  m_free_blocks[frame.order]--;
+  m_free_frames -= 1zu << frame.order;
+}
+
+void BuddyAllocator::free_range(const PhysicalAddress base,
+                                const size_t count) {
+  u32 number = base.get() / PAGE_SIZE;
+  const u32 end = number + count;
+  while (number < end) {
+    // The largest block that starts here is limited by the alignment of the
+    // frame number and by what is left of the range.
+    u8 order = number ? __builtin_ctz(number) : BUDDY_MAX_ORDER;
+    order = min<u8>(order, BUDDY_MAX_ORDER);
+    while (number + (1u << order) > end)
+      order--;
+    free(PhysicalAddress(number * PAGE_SIZE), order);
+    number += 1u << order;
+  }
+}
+
+PhysicalAddress BuddyAllocator::allocate(const u8 order) {
+  u8 current = order;
+  while (current <= BUDDY_MAX_ORDER && !m_free_lists[current])
+    current++;
+  if (current > BUDDY_MAX_ORDER)
+    return {};
+
+  PageFrame &head = *m_free_lists[current];
+  remove(head);
+  const u32 number = frame_number(head);
+
+  // Split the block, giving the upper half back each time, until it has the
+  // requested size.
+  while (current > order) {
+    current--;
+    insert(*frame(number + (1u << current)), current);
+  }
+  return PhysicalAddress(number * PAGE_SIZE);
+}
+
+void BuddyAllocator::free(const PhysicalAddress addr, u8 order) {
+  u32 number = addr.get() / PAGE_SIZE;
+  ASSERT(frame(number) && !frame(number)->free_head);
+  ASSERT(!frame(number)->shares);
+  ASSERT((number & ((1u << order) - 1)) == 0);
+
+  while (order < BUDDY_MAX_ORDER) {
+    PageFrame *buddy = frame(number ^ (1u << order));
+    if (!buddy || !buddy->free_head || buddy->order != order)
+      break;
+    remove(*buddy);
+    number &= ~(1u << order);
+    order++;
+  }
+  insert(*frame(number), order);
+}
+
+PhysicalAddress BuddyAllocator::allocate_contiguous(const size_t count) {
+  const u8 order = order_for(count);
+  if (order > BUDDY_MAX_ORDER)
+    return {};
+  const PhysicalAddress base = allocate(order);
+  if (base.get() && count < (1zu << order))
+    free_range(PhysicalAddress(base.get() + count * PAGE_SIZE),
+               (1zu << order) - count);
+  return base;
+}
+
+void BuddyAllocator::dump() const {
+  println("[buddy] {} frames free", m_free_frames);
+  for (u8 order = 0; order <= BUDDY_MAX_ORDER; order++) {
+    if (m_free_blocks[order])
+      println("  order {} ({} KiB): {} free", order, (4u << order),
+              m_free_blocks[order]);
+  }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Common.hpp"
+#include <LibCore/Types.hpp>
+
+// Blocks of up to 2^BUDDY_MAX_ORDER pages (4 MiB) are handed out.
+#define BUDDY_MAX_ORDER 10
+#define BUDDY_ORDERS (BUDDY_MAX_ORDER + 1)
+
+// Bookkeeping for one physical page frame. Frames are described out of line,
+// so the allocator never has to touch (or map) the memory it manages.
+struct PageFrame {
+  PageFrame *next_free, *prev_free; // valid while the frame heads a free block
+  u8 order;                         // of the free block this frame heads
+  bool free_head;
+  union {
+    u16 shares;    // copy-on-write references beyond the first owner
+    u16 pte_count; // entries in use while the frame holds a user page table
+  };
+};
+
+// Binary buddy allocator for physical page frames. A free block of order n is
+// 2^n frames aligned to its own size, so its buddy is found by flipping bit n
+// of the frame number; freeing merges with free buddies, at most one per
+// order.
+class BuddyAllocator {
+public:
+  // `frames` describes the `count` frames starting at frame number
+  // `first_frame`; they all start out allocated.
+  void initialize(PageFrame *frames, u32 first_frame, size_t count);
+
+  // Hands the frames in [base, base + count * PAGE_SIZE) to the allocator.
+  void free_range(PhysicalAddress base, size_t count);
+
+  PhysicalAddress allocate(u8 order);
+  void free(PhysicalAddress, u8 order);
+
+  // Allocates `count` physically contiguous frames; the part of the block that
+  // is not needed goes straight back to the free lists.
+  PhysicalAddress allocate_contiguous(size_t count);
+
+  PageFrame &frame_for(PhysicalAddress);
+
+  size_t frame_count() const { return m_frame_count; }
+  size_t free_frames() const { return m_free_frames; }
+  size_t free_blocks(u8 order) const { return m_free_blocks[order]; }
+
+  void dump() const;
+
+  static u8 order_for(size_t count);
+
+private:
+  PageFrame *frame(u32 frame_number);
+  u32 frame_number(const PageFrame &frame) const {
+    return m_first_frame + (&frame - m_frames);
+  }
+
+  void insert(PageFrame &, u8 order);
+  void remove(PageFrame &);
+
+  PageFrame *m_frames = nullptr;
+  u32 m_first_frame = 0;
+  size_t m_frame_count = 0;
+  size_t m_free_frames = 0;
+  PageFrame *m_free_lists[BUDDY_ORDERS] = {};
+  size_t m_free_blocks[BUDDY_ORDERS] = {};
+};
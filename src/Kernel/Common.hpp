@@ -22,10 +22,24 @@ inline bool get_symbol(symbol_t *symbol, u32 addr) {
   return false;
 }
 
-inline void print_stack_trace(u32 max_frames = 100) {
-  u32 *addresses = new u32[max_frames];
-  int num_addresses = walk_stack(addresses, max_frames);
+// Finds the function that contains `addr`. The generated symbol table is
+// sorted by address and ends with a 0xffffffff sentinel.
+inline bool get_symbol_containing(symbol_t *symbol, u32 addr) {
+  if (!__symbol_tab_size || addr < __symbol_tab[0].address)
+    return false;
+  u32 low = 0, high = __symbol_tab_size;
+  while (high - low > 1) {
+    const u32 middle = (low + high) / 2;
+    if (__symbol_tab[middle].address <= addr)
+      low = middle;
+    else
+      high = middle;
+  }
+  *symbol = __symbol_tab[low];
+  return true;
+}
 
+inline void print_stack_trace(const u32 *addresses, int num_addresses) {
   for (int i = 0; i < num_addresses; i++) {
     symbol_t symbol;
     if (get_symbol(&symbol, addresses[i]))
@@ -36,9 +50,15 @@ inline void print_stack_trace(u32 max_frames = 100) {
   }
 }
 
+inline void print_stack_trace(u32 max_frames = 100) {
+  u32 *addresses = new u32[max_frames];
+  int num_addresses = walk_stack(addresses, max_frames);
+  print_stack_trace(addresses, num_addresses);
+}
+
 template <typename... Args>
-void kpanic(const char *file, usz line, const char *fn, const char *fmt,
-            Args... args) {
+[[noreturn]] void kpanic(const char *file, usz line, const char *fn,
+                         const char *fmt, Args... args) {
   print("\033[31;1mPANIC! (at {}:{} in {}): \033[0m", file, line, fn);
   println(fmt, args...);
 
@@ -6,17 +6,24 @@
 #include "Process.hpp"
 #include "kprintf.hpp"
 
-extern "C" void handle_interrupt();
+extern "C" void ide_handle_interrupt();
 
 namespace Disk {
 
   IDEDrive drive[4];
   static volatile bool interrupted;
+  static u32 s_sector_count;
+
+  // Status polls before a transfer step is given up on.
+  static constexpr u32 POLL_LIMIT = 1000000;
+  // Sectors per command; the count register is 8 bits wide.
+  static constexpr u16 MAX_TRANSFER = 128;
 
 #define IRQ_FIXED_DISK 14
 
   extern "C" void ide_isr();
-  asm(".globl ide_isr \n"
+  asm(".pushsection .text\n"
+      ".globl ide_isr \n"
       "ide_isr: \n"
       "    pusha\n"
       "    pushw %ds\n"
@@ -25,11 +32,12 @@ namespace Disk {
       "    pushw %ss\n"
       "    popw %ds\n"
       "    popw %es\n"
-      "    call handle_interrupt\n"
+      "    call ide_handle_interrupt\n"
       "    popw %es\n"
       "    popw %ds\n"
       "    popa\n"
-      "    iret\n");
+      "    iret\n"
+      ".popsection\n");
 
   static void enable_irq() { PIC::enable(IRQ_FIXED_DISK); }
   static void disable_irq() { PIC::disable(IRQ_FIXED_DISK); }
@@ -87,9 +95,92 @@ namespace Disk {
     drive[0].cylinders = wbufbase[1];
     drive[0].heads = wbufbase[3];
     drive[0].sectors_per_track = wbufbase[6];
+    s_sector_count = wbufbase[60] | (wbufbase[61] << 16);
 
     debugln("ide0: Master=\"{}\", C/H/Spt={}/{}/{}\n", bbuf.pointer() + 54,
             drive[0].cylinders, drive[0].heads, drive[0].sectors_per_track);
   }
 
+  u32 sector_count() { return s_sector_count; }
+
+  // Waits for the drive to leave the busy state, and with `need_data` for it
+  // to have a sector ready to be transferred.
+  static bool wait_until_ready(const bool need_data) {
+    for (u32 i = 0; i < POLL_LIMIT; i++) {
+      const u8 status = IO::read8(IDE0_STATUS);
+      if (status & BUSY)
+        continue;
+      if (status & ERR)
+        return false;
+      if (!need_data || (status & DRQ))
+        return true;
+    }
+    return false;
+  }
+
+  static bool start_transfer(const u32 sector_index, const u8 count,
+                             const u8 command) {
+    if (!wait_until_ready(false))
+      return false;
+    IO::write8(IDE0_DRIVE_HEAD, 0xE0 | ((sector_index >> 24) & 0x0F));
+    IO::write8(IDE0_SECTOR_COUNT, count);
+    IO::write8(IDE0_LBA_LOW, sector_index & 0xff);
+    IO::write8(IDE0_LBA_MID, (sector_index >> 8) & 0xff);
+    IO::write8(IDE0_LBA_HIGH, (sector_index >> 16) & 0xff);
+    IO::write8(IDE0_COMMAND, command);
+    return true;
+  }
+
+  bool read_sectors(u32 sector_index, u16 count, u8 *buffer) {
+    InterruptDisabler disabler;
+    while (count) {
+      const u16 chunk = min(count, MAX_TRANSFER);
+      if (!start_transfer(sector_index, chunk, READ_SECTORS))
+        return false;
+      for (u16 sector = 0; sector < chunk; sector++) {
+        if (!wait_until_ready(true)) {
+          errorln("disk: read of sector {} failed", sector_index + sector);
+          return false;
+        }
+        for (u32 i = 0; i < SECTOR_SIZE / 2; i++) {
+          const u16 data = IO::read16(IDE0_DATA);
+          *(buffer++) = LSB(data);
+          *(buffer++) = MSB(data);
+        }
+      }
+      sector_index += chunk;
+      count -= chunk;
+    }
+    return true;
+  }
+
+  bool write_sectors(u32 sector_index, u16 count, const u8 *buffer) {
+    InterruptDisabler disabler;
+    while (count) {
+      const u16 chunk = min(count, MAX_TRANSFER);
+      if (!start_transfer(sector_index, chunk, WRITE_SECTORS))
+        return false;
+      for (u16 sector = 0; sector < chunk; sector++) {
+        if (!wait_until_ready(true)) {
+          errorln("disk: write of sector {} failed", sector_index + sector);
+          return false;
+        }
+        for (u32 i = 0; i < SECTOR_SIZE / 2; i++) {
+          IO::write16(IDE0_DATA, buffer[0] | (buffer[1] << 8));
+          buffer += 2;
+        }
+      }
+      sector_index += chunk;
+      count -= chunk;
+    }
+
+    // The data may still sit in the drive's write cache.
+    if (!wait_until_ready(false))
+      return false;
+    IO::write8(IDE0_COMMAND, FLUSH_CACHE);
+    return wait_until_ready(false);
+  }
+
 } // namespace Disk
+
+extern "C" void ide_handle_interrupt() { Disk::interrupt(); }
@@ -3,13 +3,23 @@
 #include <LibCore/Types.hpp>
 
 #define IDE0_DATA 0x1F0
+#define IDE0_SECTOR_COUNT 0x1F2
+#define IDE0_LBA_LOW 0x1F3
+#define IDE0_LBA_MID 0x1F4
+#define IDE0_LBA_HIGH 0x1F5
+#define IDE0_DRIVE_HEAD 0x1F6
 #define IDE0_STATUS 0x1F7
 #define IDE0_COMMAND 0x1F7
 #define BUSY 0x80
 #define DRDY 0x40
 #define DRQ 0x08
+#define ERR 0x01
 #define IDENTIFY_DRIVE 0xEC
 #define READ_SECTORS 0x21
+#define WRITE_SECTORS 0x31
+#define FLUSH_CACHE 0xE7
+
+#define SECTOR_SIZE 512
 
 #define IDE0_DISK0 0
 #define IDE0_DISK1 1
@@ -25,5 +35,13 @@ extern IDEDrive drive[4];
 
 namespace Disk {
   void initialize();
+
+  // Sectors are addressed by LBA on the primary master. Transfers are polled
+  // with interrupts disabled, so they also work inside the page fault
+  // handler.
   bool read_sectors(u32 sector_index, u16 count, u8 *buffer);
+  bool write_sectors(u32 sector_index, u16 count, const u8 *buffer);
+
+  // Size of the primary master, 0 until it was identified.
+  u32 sector_count();
 } // namespace Disk
@@ -180,6 +180,18 @@ EH_ENTRY_FN(14) {
   u32 fault_page_directory;
   asm("movl %%cr3, %%eax" : "=a"(fault_page_directory));
 
+#if KMALLOC_GUARD_PAGES
+  if (kmalloc_guard_contains(fault_address))
+    kmalloc_guard_report_fault(fault_address, exception_code & 2);
+#endif
+
+  // Faults that demand paging resolves are routine, so they return before
+  // anything gets dumped.
+  const PageFaultResponse response = MM.handle_page_fault(
+      PageFault(exception_code, LinearAddress(fault_address)));
+  if (response == PageFaultResponse::Continue)
+    return;
+
   okln("Ring{} page fault in {}({}), %s laddr={}\n", regs.cs & 3,
        s_current->name().characters(), s_current->pid(),
        exception_code & 2 ? "write" : "read", fault_address);
@@ -193,16 +205,7 @@ EH_ENTRY_FN(14) {
   if (s_current->is_ring0())
     hcf();
 
-  PageFaultResponse response = MM.handle_page_fault(
-      PageFault(exception_code, LinearAddress(fault_address)));
-  switch (response) {
-  case PageFaultResponse::ShouldCrash:
-    Process::process_did_crash(s_current);
-    break;
-  case PageFaultResponse::Continue:
-    warnln("Continuing after resolved page fault.");
-    break;
-  }
+  Process::process_did_crash(s_current);
 }
 
 #define EH(n, msg)                                                             \
@@ -116,6 +116,12 @@ inline u32 cpu_flags() {
   return flags;
 }
 
+inline u64 read_tsc() {
+  u32 lsw, msw;
+  asm volatile("rdtsc" : "=a"(lsw), "=d"(msw));
+  return ((u64)msw << 32) | lsw;
+}
+
 class InterruptDisabler {
 public:
   InterruptDisabler() {
@@ -31,6 +31,20 @@ CORE_MAKE_ENUM(Color, Test, Red = Test(0xff0000), Green = Test(0x00ff00),
 
 System system;
 
+static bool has_cmdline_option(const char *cmdline, const char *option) {
+  const size_t length = strlen(option);
+  for (const char *word = cmdline; *word;) {
+    while (*word == ' ')
+      word++;
+    if (!strncmp(word, option, length) &&
+        (word[length] == ' ' || word[length] == '\0'))
+      return true;
+    while (*word && *word != ' ')
+      word++;
+  }
+  return false;
+}
+
 static void undertaker_main() NORETURN;
 static void undertaker_main() {
   for (;;) {
@@ -44,6 +58,7 @@ static void init_stage2() {
   okln("init stage2...");
 
   Disk::initialize();
+  MM.initialize_swap();
 
   VGA vga;
   vga.clear();
@@ -61,6 +76,12 @@ static void init_stage2() {
   OwnPtr<String> s = make<String>("Hello, world!\n");
   vga.puts(*s);
 
+  if (g_dump_kmalloc_stacks) {
+    kmalloc_dump_stats();
+    kmalloc_dump_profile();
+    dump_object_pools();
+  }
+
   for (;;) {
     sleep(3600 * TICKS_PER_SECOND);
     asm("hlt");
@@ -82,29 +103,31 @@ extern "C" void kmain(const u32 multiboot_magic, const usz multiboot_ptr) {
   ASSERT(mbi->flags & MULTIBOOT_INFO_CMDLINE);
   ASSERT(mbi->flags & MULTIBOOT_INFO_MEM_MAP);
 
-  {
-
-    okln("mmap_addr = 0x{:x}, mmap_length = 0x{:x}", mbi->mmap_addr,
-         mbi->mmap_length);
-    for (auto *mmap =
-             reinterpret_cast<multiboot_memory_map_t *>(mbi->mmap_addr);
-         reinterpret_cast<unsigned long>(mmap) <
-         mbi->mmap_addr + mbi->mmap_length;
-         mmap = reinterpret_cast<multiboot_memory_map_t *>(
-             reinterpret_cast<unsigned long>(mmap) + mmap->size +
-             sizeof(mmap->size)))
-      okln(" size = 0x{:x}, base_addr = 0x{:x}{:x}, length = 0x{:x}{:x}, "
-           "type = 0x{:x}",
-           mmap->size, mmap->addr >> 32, mmap->addr & 0xffffffff,
-           mmap->len >> 32, mmap->len & 0xffffffff, mmap->type);
-  }
+  g_dump_kmalloc_stacks = has_cmdline_option(
+      reinterpret_cast<const char *>(mbi->cmdline), "kmalloc_profile");
 
   RTC::initialize();
   PIC::init();
   GDT::init();
   IDT::init();
 
-  MemoryManager::initialize();
+  MemoryManager::initialize(*mbi);
+
+#if KMALLOC_GUARD_PAGES
+  kmalloc_guard_init();
+#endif
+
+#if KMALLOC_BENCHMARK
+  kmalloc_benchmark();
+#endif
+
+#if MM_SWITCH_BENCHMARK
+  MM.benchmark_context_switch();
+#endif
+
+#if MM_CLONE_BENCHMARK
+  MM.benchmark_clone();
+#endif
 
   PIT::initialize();
 
@@ -124,6 +147,11 @@ extern "C" void kmain(const u32 multiboot_magic, const usz multiboot_ptr) {
 
   sti();
 
-  for (;;)
-    asm("hlt");
+  // The kernel task only runs when no other process wants to; it swaps pages
+  // out while free frames are short, and clears free frames for the memory
+  // manager until there are enough of them.
+  for (;;) {
+    if (!MM.swap_idle_pages() && !MM.zero_idle_pages())
+      asm("hlt");
+  }
 }
@@ -1,28 +1,182 @@
 #include "MemoryManager.hpp"
 #include "Common.hpp"
+#include "Disk.hpp"
 #include "Interrupts/Interrupts.hpp"
 #include "LibCore/RetainPtr.hpp"
 #include "LibCore/Vector.hpp"
+#include "Multiboot.hpp"
+#include "PIT.hpp"
 #include "Process.hpp"
 #include "kmalloc.hpp"
 #include "kprintf.hpp"
+#include "vmalloc.hpp"
+#include "zram.hpp"
 #include <LibCore/Defines.hpp>
 #include <LibCore/Types.hpp>
 
+// End of the kernel image, including its bss and boot stack.
+extern "C" u8 _end[];
+
 static MemoryManager *s_instance;
 
+static void load_page_directory(const u32 *page_directory) {
+  asm volatile("movl %%eax, %%cr3" ::"a"(page_directory) : "memory");
+}
+
+static u32 read_cr4() {
+  u32 cr4;
+  asm volatile("movl %%cr4, %0" : "=r"(cr4));
+  return cr4;
+}
+
+static void write_cr4(const u32 cr4) {
+  asm volatile("movl %0, %%cr4" ::"r"(cr4) : "memory");
+}
+
+// 4 MiB pages and global pages: the CPUID.1:EDX bit advertising each and the
+// CR4 bit turning it on.
+static constexpr u32 CPUID_PSE = 1 << 3, CR4_PSE = 1 << 4;
+static constexpr u32 CPUID_PGE = 1 << 13, CR4_PGE = 1 << 7;
+
+static bool enable_paging_feature(const u32 cpuid_bit, const u32 cr4_bit) {
+  u32 eax = 1, ebx, ecx, edx;
+  asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+  if (!(edx & cpuid_bit))
+    return false;
+  write_cr4(read_cr4() | cr4_bit);
+  return true;
+}
+
 MemoryManager &MM { return *s_instance; }
 
-MemoryManager::MemoryManager() {
+MemoryManager::MemoryManager(const multiboot_info &mbi) {
   m_page_directory = reinterpret_cast<u32 *>(0x5000);
   m_page_table_zero = reinterpret_cast<u32 *>(0x6000);
   m_page_table_one = reinterpret_cast<u32 *>(0x7000);
 
+  initialize_page_frames(mbi);
   initialize_paging();
 }
 
 MemoryManager::~MemoryManager() = default;
 
+// Frame numbers rather than addresses, so the top of 4 GiB does not wrap.
+struct FrameRange {
+  u32 first, end;
+};
+
+#define MAX_RESERVED_RANGES 8
+
+// Calls `callback(first, end)` with the whole frames of every range the
+// memory map marks as usable. Only memory below USER_BASE is identity mapped
+// in every address space, so that is all the kernel manages.
+template <typename Callback>
+static void for_each_usable_range(const multiboot_info &mbi,
+                                  Callback callback) {
+  constexpr u64 frame_limit = USER_BASE / PAGE_SIZE;
+  for (u32 entry = mbi.mmap_addr; entry < mbi.mmap_addr + mbi.mmap_length;) {
+    const auto &mmap = *reinterpret_cast<const multiboot_memory_map_t *>(entry);
+    entry += mmap.size + sizeof(mmap.size);
+    if (mmap.type != MULTIBOOT_MEMORY_AVAILABLE)
+      continue;
+
+    const u64 first = (mmap.addr + PAGE_SIZE - 1) >> 12;
+    const u64 end = min((mmap.addr + mmap.len) >> 12, frame_limit);
+    if (first < end)
+      callback((u32)first, (u32)end);
+  }
+}
+
+// Returns the first frame of a run of `count` frames in [first, end) that
+// does not overlap any reserved range, or 0 if there is none.
+static u32 find_unreserved_frames(const FrameRange *reserved,
+                                  const size_t reserved_count, u32 first,
+                                  const u32 end, const u32 count) {
+  for (size_t i = 0; i < reserved_count && first + count <= end;) {
+    if (reserved[i].first < first + count && first < reserved[i].end) {
+      first = reserved[i].end;
+      i = 0;
+      continue;
+    }
+    i++;
+  }
+  return first + count <= end ? first : 0;
+}
+
+void MemoryManager::initialize_page_frames(const multiboot_info &mbi) {
+  FrameRange reserved[MAX_RESERVED_RANGES];
+  size_t reserved_count = 0;
+  auto reserve = [&](const u32 base, const u32 size) {
+    ASSERT(reserved_count < MAX_RESERVED_RANGES);
+    reserved[reserved_count++] = {base / PAGE_SIZE,
+                                  Core::ceil_div(base + size, PAGE_SIZE)};
+  };
+
+  // Real mode memory, the paging structures at 0x5000 and the kernel image,
+  // which is loaded at 0x10000.
+  reserve(0, max<u32>(1 * MB, reinterpret_cast<u32>(_end)));
+  reserve(KMALLOC_POOL_BASE, KMALLOC_POOL_SIZE);
+  // Backs the fixmap window.
+  reserve(FIXMAP_BASE, FIXMAP_SLOTS * PAGE_SIZE);
+  reserve(reinterpret_cast<u32>(&mbi), sizeof(mbi));
+  reserve(mbi.mmap_addr, mbi.mmap_length);
+  reserve(mbi.cmdline,
+          strlen(reinterpret_cast<const char *>(mbi.cmdline)) + 1);
+
+  u32 frame_count = 0;
+  for_each_usable_range(mbi, [&](const u32 first, const u32 end) {
+    okln("[MM] usable memory @ P{:x}, {} KiB", first * PAGE_SIZE,
+         (end - first) * (PAGE_SIZE / KB));
+    frame_count = max(frame_count, end);
+  });
+
+  // The frame database describes every frame up to the end of usable memory
+  // and is itself placed in the first usable run that is large enough.
+  const u32 database_frames =
+      Core::ceil_div<u32>(frame_count * sizeof(PageFrame), PAGE_SIZE);
+  u32 database = 0;
+  for_each_usable_range(mbi, [&](const u32 first, const u32 end) {
+    if (!database)
+      database = find_unreserved_frames(reserved, reserved_count, first, end,
+                                        database_frames);
+  });
+  if (!database)
+    PANIC("[MM] no room for the page frame database ({} frames)",
+          database_frames);
+  reserve(database * PAGE_SIZE, database_frames * PAGE_SIZE);
+
+  m_page_allocator.initialize(
+      reinterpret_cast<PageFrame *>(database * PAGE_SIZE), 0, frame_count);
+  auto reserved_end = [&](const u32 frame) -> u32 {
+    for (size_t i = 0; i < reserved_count; i++) {
+      if (reserved[i].first <= frame && frame < reserved[i].end)
+        return reserved[i].end;
+    }
+    return 0;
+  };
+  for_each_usable_range(mbi, [&](u32 frame, const u32 end) {
+    while (frame < end) {
+      if (const u32 skip_to = reserved_end(frame)) {
+        frame = skip_to;
+        continue;
+      }
+      u32 next = end;
+      for (size_t i = 0; i < reserved_count; i++) {
+        if (reserved[i].first > frame)
+          next = min(next, reserved[i].first);
+      }
+      m_page_allocator.free_range(PhysicalAddress(frame * PAGE_SIZE),
+                                  next - frame);
+      m_total_frames += next - frame;
+      frame = next;
+    }
+  });
+
+  okln("[MM] {} of {} page frames free ({} MiB), frame database @ P{:x}",
+       free_frames(), m_total_frames, m_total_frames / (MB / PAGE_SIZE),
+       database * PAGE_SIZE);
+}
+
 void MemoryManager::initialize_paging() {
   static_assert(sizeof(MemoryManager::PageDirectoryEntry) == 4);
   static_assert(sizeof(MemoryManager::PageTableEntry) == 4);
@@ -32,36 +186,198 @@ void MemoryManager::initialize_paging() {
 
   okln("[MM] Page directory @ {:p}", m_page_directory);
 
+  m_has_pse = enable_paging_feature(CPUID_PSE, CR4_PSE);
+  m_has_pge = enable_paging_feature(CPUID_PGE, CR4_PGE);
+
   // this makes sure that nullptr dereferencing ends up crashing.
   protect_map(LinearAddress(0), 4 * KB);
 
-  identity_map(LinearAddress(4096), 4 * KB);
+  // The kernel heap grows from inside kmalloc(), where allocating a page table
+  // (and logging about it) would recurse into the heap, so the page tables
+  // covering the grow range (and the guard slots right after it) are created
+  // up front, and so are those of the vmalloc range, which kmalloc() uses
+  // for large requests. So are the ones covering physical memory: process
+  // page directories copy the kernel PDEs once, so those must never change
+  // later.
+  // Whole 4 MiB spans of physical memory past the first two page tables
+  // (which hold the null page guard and the fixmap window) are identity
+  // mapped with one large page each, if the CPU has them, before any page
+  // table could be placed in them. The rest of physical memory, and at least
+  // the low 8 MiB holding the kernel image, the boot heap and the frame
+  // database, gets 4 KiB identity mappings, except for the null page and the
+  // fixmap window, which map_temporary() fills in.
+  {
+    InterruptDisabler disabler;
+    const u32 memory_end = m_page_allocator.frame_count() * PAGE_SIZE;
+    auto is_large_span = [&](const u32 addr) {
+      return m_has_pse && addr >= 8 * MB && memory_end - addr >= 4 * MB;
+    };
 
-  for (size_t i = (4 * MB) + PAGE_SIZE; i < (8 * MB); i += PAGE_SIZE)
-    m_free_pages.push(PhysicalAddress(i));
+    for (u32 addr = 0; addr < memory_end; addr += 4 * MB) {
+      if (is_large_span(addr))
+        map_large_page(m_page_directory, LinearAddress(addr),
+                       PhysicalAddress(addr), false);
+    }
+
+    u32 heap_end = KMALLOC_GROW_BASE + KMALLOC_GROW_SIZE;
+#if KMALLOC_GUARD_PAGES
+    heap_end = KMALLOC_GUARD_BASE + KMALLOC_GUARD_SIZE;
+#endif
+    for (u32 addr = KMALLOC_GROW_BASE; addr < heap_end; addr += 4 * MB)
+      ensure_pte(LinearAddress(addr));
+    for (u32 addr = VMALLOC_BASE; addr < VMALLOC_BASE + VMALLOC_SIZE;
+         addr += 4 * MB)
+      ensure_pte(LinearAddress(addr));
+    const u32 identity_end = max<u32>(memory_end, 8 * MB);
+    const u32 fixmap_end = FIXMAP_BASE + FIXMAP_SLOTS * PAGE_SIZE;
+    identity_map(LinearAddress(PAGE_SIZE), FIXMAP_BASE - PAGE_SIZE);
+    identity_map(LinearAddress(fixmap_end), identity_end - fixmap_end);
+  }
 
-  asm volatile("movl %%eax, %%cr3" ::"a"(m_page_directory));
-  asm volatile("movl %cr0, %eax\n"
-               "orl $80000001, %eax\n"
-               "movl %eax, %cr0\n");
+  if (m_has_pse)
+    okln("[MM] {} MiB identity mapped with 4 MiB pages",
+         m_kernel_large_pages * 4);
+  else
+    okln("[MM] CPU has no 4 MiB pages, using 4 KiB pages only");
+
+  load_page_directory(m_page_directory);
+  asm volatile("movl %%cr0, %%eax\n"
+               "orl $0x80000000, %%eax\n"
+               "movl %%eax, %%cr0\n" ::
+                   : "eax", "memory");
+
+  {
+    InterruptDisabler disabler;
+    m_zero_page = allocate_physical_page();
+    ASSERT(m_zero_page.get());
+    u8 *zero_page = map_temporary(m_zero_page);
+    memset(zero_page, 0, PAGE_SIZE);
+    unmap_temporary(zero_page);
+
+    while (m_page_table_pool_count < PAGE_TABLE_POOL_SIZE)
+      if (!grow_page_table_pool())
+        break;
+  }
+}
+
+// Adds a freshly zeroed frame to the page table pool.
+bool MemoryManager::grow_page_table_pool() {
+  const PhysicalAddress page = allocate_physical_page();
+  if (!page.get())
+    return false;
+  auto *page_table = reinterpret_cast<u32 *>(page.get());
+  memset(page_table, 0, PAGE_SIZE);
+  m_page_table_pool[m_page_table_pool_count++] = page_table;
+  return true;
 }
 
 void *MemoryManager::allocate_page_table() {
-  auto ppages = allocate_physical_pages(1);
-  const u32 addr = ppages.at(0).get();
-  identity_map(LinearAddress(addr), 4096);
-  return reinterpret_cast<void *>(addr);
+  // NOTE: this can run underneath kmalloc() while the heap grows, so it must
+  //       not allocate from the heap itself.
+  if (!m_page_table_pool_count) {
+    const bool grown = grow_page_table_pool();
+    ASSERT(grown);
+  }
+  return m_page_table_pool[--m_page_table_pool_count];
 }
 
-auto MemoryManager::ensure_pte(const LinearAddress addr) -> PageTableEntry {
+void MemoryManager::release_page_table(u32 *page_table, const bool zeroed) {
+  page_table_frame(page_table).pte_count = 0;
+  m_user_page_tables--;
+  if (m_page_table_pool_count == PAGE_TABLE_POOL_SIZE) {
+    m_page_allocator.free(PhysicalAddress(reinterpret_cast<u32>(page_table)),
+                          0);
+    return;
+  }
+  if (!zeroed)
+    memset(page_table, 0, PAGE_SIZE);
+  m_page_table_pool[m_page_table_pool_count++] = page_table;
+}
+
+void MemoryManager::map_user_page(const Process &process,
+                                  const LinearAddress laddr,
+                                  const PhysicalAddress page,
+                                  const bool writable) {
+  auto pte = ensure_pte(process.m_page_directory, laddr);
+  if (!pte.raw()) {
+    const auto pde =
+        PageDirectoryEntry(&process.m_page_directory[laddr.get() >> 22]);
+    page_table_frame(pde.page_table_base()).pte_count++;
+  } else if (pte.is_swapped()) {
+    *pte.ptr() = 0;
+  }
+  pte.set_physical_page_base(page.get());
+  pte.set_present(true);
+  pte.set_writable(writable);
+  pte.set_user_allowed(!process.is_ring0());
+}
+
+void MemoryManager::unmap_user_page(const Process &process,
+                                    const LinearAddress laddr) {
+  const auto pde =
+      PageDirectoryEntry(&process.m_page_directory[laddr.get() >> 22]);
+  if (!pde.is_present())
+    return;
+  // Splits a large page, leaving a table with all of its entries in use.
+  auto pte = ensure_pte(process.m_page_directory, laddr);
+  if (!pte.raw())
+    return;
+  *pte.ptr() = 0;
+
+  u32 *page_table = pde.page_table_base();
+  if (--page_table_frame(page_table).pte_count)
+    return;
+  *pde.ptr() = 0;
+  release_page_table(page_table, true);
+}
+
+u32 *MemoryManager::find_pte(u32 *page_directory, const LinearAddress laddr) {
+  const auto pde = PageDirectoryEntry(&page_directory[laddr.get() >> 22]);
+  if (!pde.is_present() || pde.is_large())
+    return nullptr;
+  return &pde.page_table_base()[(laddr.get() >> 12) & 0x3ff];
+}
+
+auto MemoryManager::ensure_pte(u32 *page_directory, const LinearAddress addr)
+    -> PageTableEntry {
   // make sure interrupts are disabled
   ASSERT(!(cpu_flags() & 0x200));
   const u32 page_directory_index = (addr.get() >> 22) & 0x3ff;
   const u32 page_table_index = (addr.get() >> 12) & 0x3ff;
 
-  const auto pde = PageDirectoryEntry(&m_page_directory[page_directory_index]);
+  // User addresses only exist in process page directories, kernel addresses
+  // only in the kernel one (the processes share its page tables).
+  const bool is_user = addr.get() >= USER_BASE && addr.get() < KERNEL_BASE;
+  ASSERT(is_user == (page_directory != m_page_directory));
+
+  const auto pde = PageDirectoryEntry(&page_directory[page_directory_index]);
+  if (pde.is_present() && pde.is_large()) {
+    // Fall back to 4 KiB pages for the whole span, e.g. to change part of it.
+    ASSERT(is_user || !m_process_page_directories);
+    auto *page_table = static_cast<u32 *>(allocate_page_table());
+    const u32 base = pde.raw() & 0xffc00000;
+    const u32 flags = pde.raw() & (PageDirectoryEntry::PRESENT |
+                                   PageDirectoryEntry::READ_WRITE |
+                                   PageDirectoryEntry::USER_SUPERVISOR |
+                                   PageDirectoryEntry::GLOBAL);
+    for (u32 i = 0; i < 1024; i++)
+      page_table[i] = (base + i * PAGE_SIZE) | flags;
+    *pde.ptr() = reinterpret_cast<u32>(page_table) | flags;
+    if (is_user) {
+      page_table_frame(page_table).pte_count = 1024;
+      m_user_page_tables++;
+      m_user_large_pages--;
+    } else {
+      m_kernel_large_pages--;
+    }
+    flush_tlb(addr);
+  }
+
   if (!pde.is_present()) {
+#if MM_DEBUG
     okln("[MM] PDE {} not present, allocating", page_directory_index);
+#endif
+    ASSERT(is_user || !m_process_page_directories);
 
     if (page_directory_index == 0) {
       pde.set_page_table_base(reinterpret_cast<u32>(m_page_table_zero));
@@ -69,10 +385,13 @@ auto MemoryManager::ensure_pte(const LinearAddress addr) -> PageTableEntry {
       pde.set_page_table_base(reinterpret_cast<u32>(m_page_table_one));
     } else {
       auto *page_table = allocate_page_table();
+#if MM_DEBUG
       okln("[MM] allocated page table #{} (for laddr={:p}) at {:p}",
            page_directory_index, addr.get(), page_table);
-      memset(page_table, 0, 4096);
+#endif
       pde.set_page_table_base(reinterpret_cast<u32>(page_table));
+      if (is_user)
+        m_user_page_tables++;
     }
 
     pde.set_user_allowed(true);
@@ -83,8 +402,57 @@ auto MemoryManager::ensure_pte(const LinearAddress addr) -> PageTableEntry {
   return PageTableEntry(&pde.page_table_base()[page_table_index]);
 }
 
+void MemoryManager::map_large_page(u32 *page_directory,
+                                   const LinearAddress laddr,
+                                   const PhysicalAddress paddr,
+                                   const bool user_allowed) {
+  ASSERT(!(laddr.get() & (4 * MB - 1)) && !(paddr.get() & (4 * MB - 1)));
+  const bool is_user = page_directory != m_page_directory;
+  const auto pde = PageDirectoryEntry(&page_directory[laddr.get() >> 22]);
+  if (pde.is_present() && !pde.is_large()) {
+    // A page table left behind by an earlier 4 KiB mapping of the span.
+    ASSERT(is_user);
+    release_page_table(pde.page_table_base(), false);
+  }
+  if (!pde.is_present() || !pde.is_large())
+    (is_user ? m_user_large_pages : m_kernel_large_pages)++;
+
+  *pde.ptr() = paddr.get();
+  pde.set_large(true);
+  pde.set_present(true);
+  pde.set_writable(true);
+  pde.set_user_allowed(user_allowed);
+  pde.set_global(!is_user);
+}
+
+// Maps the 4 MiB at `laddr` with one large page if the zone pages behind it
+// are one aligned, physically contiguous block that is not shared.
+bool MemoryManager::map_zone_large_page(const Process &process,
+                                        const Zone &zone, const size_t index,
+                                        const LinearAddress laddr) {
+  constexpr size_t count = 4 * MB / PAGE_SIZE;
+  if (!m_has_pse || (laddr.get() & (4 * MB - 1)) ||
+      index + count > zone.m_pages.size())
+    return false;
+
+  const u32 base = zone.m_pages.at(index).get();
+  if (!base || (base & (4 * MB - 1)))
+    return false;
+  for (size_t i = 0; i < count; i++) {
+    const PhysicalAddress page = zone.m_pages.at(index + i);
+    if (page.get() != base + i * PAGE_SIZE || is_frame_shared(page))
+      return false;
+  }
+
+  map_large_page(process.m_page_directory, laddr, PhysicalAddress(base),
+                 !process.is_ring0());
+  flush_tlb(process, laddr);
+  return true;
+}
+
 void MemoryManager::protect_map(LinearAddress addr, size_t length) {
   InterruptDisabler disabler;
+  TLBFlushBatch batch;
   for (u32 offset = 0; offset < length; offset += 4096) {
     auto pte_addr = addr.offset(offset);
     auto pte = ensure_pte(pte_addr);
@@ -92,38 +460,219 @@ void MemoryManager::protect_map(LinearAddress addr, size_t length) {
     pte.set_user_allowed(false);
     pte.set_present(false);
     pte.set_writable(false);
-    flush_tlb(pte_addr);
+    batch.add(pte_addr);
   }
 }
 
 void MemoryManager::identity_map(const LinearAddress addr,
                                  const size_t length) {
   InterruptDisabler disabler;
+  TLBFlushBatch batch;
   for (u32 offset = 0; offset < length; offset += 4096) {
     auto pte_addr = addr.offset(offset);
+    // Already covered by a large identity mapping.
+    if (PageDirectoryEntry(&m_page_directory[pte_addr.get() >> 22]).is_large())
+      continue;
     auto pte = ensure_pte(pte_addr);
     pte.set_physical_page_base(pte_addr.get());
     pte.set_user_allowed(true);
     pte.set_present(true);
     pte.set_writable(true);
-    flush_tlb(pte_addr);
+    pte.set_global(true);
+    batch.add(pte_addr);
   }
 }
 
-void MemoryManager::initialize() { s_instance = new MemoryManager; }
+void MemoryManager::initialize(const multiboot_info &mbi) {
+  s_instance = new MemoryManager(mbi);
+}
+
+bool MemoryManager::is_initialized() { return s_instance; }
+
+u32 *MemoryManager::create_page_directory() {
+  InterruptDisabler disabler;
+  auto *page_directory = static_cast<u32 *>(allocate_page_table());
+  memcpy(page_directory, m_page_directory, PAGE_SIZE);
+  memset(&page_directory[USER_BASE >> 22], 0,
+         ((KERNEL_BASE - USER_BASE) >> 22) * sizeof(u32));
+  m_process_page_directories++;
+  return page_directory;
+}
+
+void MemoryManager::release_page_directory(u32 *page_directory) {
+  InterruptDisabler disabler;
+  ASSERT(page_directory != m_page_directory);
+  for (u32 index = USER_BASE >> 22; index < KERNEL_BASE >> 22; index++) {
+    const auto pde = PageDirectoryEntry(&page_directory[index]);
+    if (pde.is_present() && pde.is_large())
+      m_user_large_pages--;
+    else if (pde.is_present())
+      release_page_table(pde.page_table_base(), false);
+  }
+  m_page_allocator.free(
+      PhysicalAddress(reinterpret_cast<u32>(page_directory)), 0);
+  m_process_page_directories--;
+}
 
 PageFaultResponse MemoryManager::handle_page_fault(const PageFault &fault) {
   // make sure interrupts are disabled
   ASSERT(!(cpu_flags() & 0x200));
-  okln("[MM] handle_page_fault({}) at laddr={:p}", fault.code(),
-       fault.address());
-  if (fault.is_not_present())
+#if MM_DEBUG
+  debugln("[MM] handle_page_fault({}) at laddr={:p}", fault.code(),
+          fault.address());
+#endif
+  if (fault.is_not_present()) {
+    // Pages in zram are decompressed by page_in() without any disk I/O; the
+    // whole fault is timed for the zram stats.
+    const u64 start = read_tsc();
+    const bool zram = s_current && is_zram_page(*s_current, fault.address());
+    if (s_current && page_in(*s_current, fault.address(), fault.is_write())) {
+      if (zram)
+        zram_count_fault((u32)(read_tsc() - start));
+      return PageFaultResponse::Continue;
+    }
+#if MM_DEBUG
     okln("  > NP fault!");
-  else if (fault.is_protection_violation())
+#endif
+  } else if (fault.is_protection_violation()) {
+    if (fault.is_write() && s_current &&
+        copy_on_write(*s_current, fault.address()))
+      return PageFaultResponse::Continue;
+#if MM_DEBUG
     okln("  > PV fault!");
+#endif
+  }
   return PageFaultResponse::ShouldCrash;
 }
 
+// Finds the region whose zone holds the page behind `laddr`, looking in the
+// process's regions and then its subregions.
+Process::Region *MemoryManager::region_page_for(Process &process,
+                                                const LinearAddress laddr,
+                                                size_t &index) {
+  if (Process::Region *region = process.region_containing(laddr)) {
+    index = (laddr.get() - region->addr.get()) / PAGE_SIZE;
+    return index < region->zone->m_pages.size() ? region : nullptr;
+  }
+  for (auto &subregion : process.m_subregions) {
+    if (laddr.get() >= subregion->addr.get() &&
+        laddr.get() - subregion->addr.get() < subregion->size) {
+      index = subregion->offset / PAGE_SIZE +
+              (laddr.get() - subregion->addr.get()) / PAGE_SIZE;
+      Process::Region &region = *subregion->region;
+      return index < region.zone->m_pages.size() ? &region : nullptr;
+    }
+  }
+  return nullptr;
+}
+
+// Calls `callback(laddr)` for every address at which the process maps page
+// `index` of the region's zone: in the region itself and in its subregions.
+template <typename Callback>
+void MemoryManager::for_each_mapping(const Process &process,
+                                     const Process::Region &region,
+                                     const size_t index, Callback callback) {
+  if (process.region_containing(region.addr) == &region)
+    callback(region.addr.offset(index * PAGE_SIZE));
+  for (auto &subregion : process.m_subregions) {
+    const size_t first = subregion->offset / PAGE_SIZE;
+    if (subregion->region.ptr() == &region && index >= first &&
+        (index - first) * PAGE_SIZE < subregion->size)
+      callback(subregion->addr.offset((index - first) * PAGE_SIZE));
+  }
+}
+
+// Points every mapping of page `index` of the region's zone in the process at
+// the frame the zone holds for it, or at the zero page if it has none yet.
+// Those and shared frames are mapped read only, so that writing to them
+// faults.
+void MemoryManager::remap_zone_page(Process &process,
+                                    const Process::Region &region,
+                                    const size_t index) {
+  const PhysicalAddress page = region.zone->m_pages.at(index);
+  const bool writable = page.get() && !is_frame_shared(page);
+  for_each_mapping(process, region, index, [&](const LinearAddress laddr) {
+    map_user_page(process, laddr, page.get() ? page : m_zero_page, writable);
+    flush_tlb(process, laddr);
+  });
+}
+
+// Maps the page containing `laddr` if it belongs to one of the process's
+// regions or subregions. A page that was never written only gets a frame of
+// its own once it is written to; until then reads see the zero page. A page
+// that was swapped out is read back in either way.
+bool MemoryManager::page_in(Process &process, const LinearAddress laddr,
+                            const bool write) {
+  size_t index;
+  Process::Region *region = region_page_for(process, laddr, index);
+  if (!region)
+    return false;
+
+  // Making room for page tables must not swap out the page being mapped.
+  ZonePin pin(*region->zone);
+  const bool swapped = is_swapped(*region->zone, index);
+  if ((write || swapped) && !commit_zone_page(*region->zone, index).get()) {
+    errorln("[MM] page_in: out of physical pages for L{:x}", laddr.get());
+    return false;
+  }
+  remap_zone_page(process, *region, index);
+  return true;
+}
+
+bool MemoryManager::is_zram_page(Process &process, const LinearAddress laddr) {
+  size_t index;
+  Process::Region *region = region_page_for(process, laddr, index);
+  return region && is_swapped(*region->zone, index) &&
+         region->zone->m_swap_slots.at(index) >= ZRAM_SLOT_BASE;
+}
+
+// A write to a frame that is shared copy-on-write gives the writer a private
+// copy of it. Once every other sharer has done so (or is gone) the last one
+// keeps the frame and only needs its mapping made writable again.
+bool MemoryManager::copy_on_write(Process &process, const LinearAddress laddr) {
+  size_t index;
+  Process::Region *region = region_page_for(process, laddr, index);
+  if (!region)
+    return false;
+  if (!region->zone->m_pages.at(index).get())
+    return page_in(process, laddr, true);
+
+  ZonePin pin(*region->zone);
+  PhysicalAddress &page = region->zone->m_pages.at(index);
+  if (is_frame_shared(page)) {
+    const PhysicalAddress copy = allocate_frame();
+    if (!copy.get()) {
+      errorln("[MM] copy_on_write: out of physical pages for L{:x}",
+              laddr.get());
+      return false;
+    }
+    // The faulting page is still mapped (read only) at `laddr`.
+    u8 *dest = map_temporary(copy);
+    memcpy(dest, reinterpret_cast<const void *>(laddr.page_base()), PAGE_SIZE);
+    unmap_temporary(dest);
+    release_frame(page);
+    page = copy;
+  }
+  remap_zone_page(process, *region, index);
+  return true;
+}
+
+bool MemoryManager::is_frame_shared(const PhysicalAddress page) {
+  return m_page_allocator.frame_for(page).shares;
+}
+
+void MemoryManager::share_frame(const PhysicalAddress page) {
+  m_page_allocator.frame_for(page).shares++;
+}
+
+void MemoryManager::release_frame(const PhysicalAddress page) {
+  PageFrame &frame = m_page_allocator.frame_for(page);
+  if (frame.shares)
+    frame.shares--;
+  else
+    m_page_allocator.free(page, 0);
+}
+
 void MemoryManager::register_zone(Zone &zone) {
   // make sure interrupts are disabled
   ASSERT(!(cpu_flags() & 0x200));
@@ -134,9 +683,28 @@ void MemoryManager::unregister_zone(Zone &zone) {
   // make sure interrupts are disabled
   ASSERT(!(cpu_flags() & 0x200));
   m_zones.remove(&zone);
-  m_free_pages.append(Core::move(zone.m_pages));
+  for (const auto page : zone.m_pages) {
+    if (page.get())
+      release_frame(page);
+  }
+  for (const u32 slot : zone.m_swap_slots) {
+    if (slot)
+      free_swap_slot(slot);
+  }
+  zone.m_pages.clear();
+}
+
+static Core::ObjectPool<Zone, InterruptDisabler> s_zone_pool;
+
+void *Zone::operator new(size_t size) {
+  ASSERT(size == sizeof(Zone));
+  return s_zone_pool.allocate();
 }
 
+void Zone::operator delete(void *ptr) { s_zone_pool.deallocate(ptr); }
+
+Core::ObjectPoolStats Zone::pool_stats() { return s_zone_pool.stats(); }
+
 Zone::Zone(Vector<PhysicalAddress> &&pages) : m_pages(Core::move(pages)) {
   MM.register_zone(*this);
 }
@@ -154,29 +722,776 @@ Core::RetainPtr<Zone> MemoryManager::create_zone(size_t size) {
   return Core::adopt(*new Zone(Core::move(pages)));
 }
 
+Core::RetainPtr<Zone> MemoryManager::create_lazy_zone(size_t size) {
+  InterruptDisabler disabler;
+  const size_t count = Core::ceil_div(size, PAGE_SIZE);
+  ASSERT(count);
+  Vector<PhysicalAddress> pages;
+  pages.ensure_capacity(count);
+  for (size_t i = 0; i < count; i++)
+    pages.push(PhysicalAddress());
+  auto zone = Core::adopt(*new Zone(Core::move(pages)));
+  make_swappable(*zone);
+  return zone;
+}
+
+void MemoryManager::make_swappable(Zone &zone) {
+  zone.m_swap_slots.ensure_capacity(zone.m_pages.size());
+  for (size_t i = 0; i < zone.m_pages.size(); i++)
+    zone.m_swap_slots.push(0);
+}
+
+Core::RetainPtr<Zone> MemoryManager::clone_zone(Zone &zone) {
+  InterruptDisabler disabler;
+  ZonePin pin(zone);
+  Vector<PhysicalAddress> pages;
+  pages.ensure_capacity(zone.m_pages.size());
+  for (size_t i = 0; i < zone.m_pages.size(); i++) {
+    if (is_swapped(zone, i) && !swap_in(zone, i).get())
+      return nullptr;
+  }
+  for (const auto page : zone.m_pages) {
+    if (page.get())
+      share_frame(page);
+    pages.push(page);
+  }
+  auto clone = Core::adopt(*new Zone(Core::move(pages)));
+  if (!zone.m_swap_slots.is_empty())
+    make_swappable(*clone);
+  return clone;
+}
+
+PhysicalAddress MemoryManager::commit_zone_page(Zone &zone,
+                                                const size_t index) {
+  InterruptDisabler disabler;
+  PhysicalAddress &page = zone.m_pages.at(index);
+  if (!page.get())
+    page = is_swapped(zone, index) ? swap_in(zone, index)
+                                   : allocate_zeroed_page();
+  return page;
+}
+
+// Puts the frames behind zone pages [first, first + count) into `pages`,
+// allocating the missing ones and copying the shared ones, so that they can be
+// written; bit i of `fresh` is set if pages[i] is new and still has to be
+// cleared.
+bool MemoryManager::collect_zone_pages(Zone &zone, const size_t first,
+                                       const size_t count,
+                                       PhysicalAddress *pages, u32 &fresh) {
+  fresh = 0;
+  u32 changed = 0;
+  note_zone_write(zone, first, count);
+  for (size_t i = 0; i < count; i++) {
+    PhysicalAddress &page = zone.m_pages.at(first + i);
+    if (!page.get() && is_swapped(zone, first + i) &&
+        !swap_in(zone, first + i).get())
+      return false;
+    if (page.get() && is_frame_shared(page)) {
+      // The write must not show through in the zones sharing the frame.
+      const PhysicalAddress copy = allocate_frame();
+      if (!copy.get())
+        return false;
+      const PhysicalAddress both[] = {page, copy};
+      u8 *window = map_temporary(both, 2);
+      ASSERT(window);
+      memcpy(window + PAGE_SIZE, window, PAGE_SIZE);
+      unmap_temporary(window, 2);
+      release_frame(page);
+      page = copy;
+      changed |= 1u << i;
+    }
+    if (!page.get()) {
+      changed |= 1u << i;
+      page = take_zeroed_page();
+    }
+    if (!page.get()) {
+      m_zeroed_page_misses++;
+      page = allocate_frame();
+      if (!page.get())
+        return false;
+      fresh |= 1u << i;
+    }
+    pages[i] = page;
+  }
+  remap_zone_pages(zone, first, changed);
+  return true;
+}
+
+void MemoryManager::remap_zone_pages(const Zone &zone, const size_t first,
+                                     const u32 changed) {
+  if (!changed)
+    return;
+  for (Process *process = Process::first_process(); process;
+       process = process->next()) {
+    for (auto *region : process->m_regions) {
+      if (region->zone.ptr() != &zone)
+        continue;
+      for (u32 bits = changed; bits; bits &= bits - 1) {
+        const size_t index = first + __builtin_ctz(bits);
+        const PhysicalAddress page = zone.m_pages.at(index);
+        for_each_mapping(*process, *region, index, [&](LinearAddress laddr) {
+          u32 *entry = find_pte(process->m_page_directory, laddr);
+          if (!entry || !PageTableEntry(entry).is_present())
+            return;
+          map_user_page(*process, laddr, page, true);
+          flush_tlb(*process, laddr);
+        });
+      }
+    }
+  }
+}
+
+// Calls `callback(dest, done, length)` for consecutive pieces of
+// [offset, offset + size) of the zone, where `dest` maps the next `length`
+// bytes and `done` bytes came before them. Each piece spans up to
+// FIXMAP_BATCH pages; whatever new frames it has beyond the piece is zeroed.
+template <typename Callback>
+bool MemoryManager::for_each_zone_chunk(Zone &zone, const size_t offset,
+                                        const size_t size, Callback callback) {
+  if (offset > zone.size() || zone.size() - offset < size) {
+    errorln("[MM] can't fit {} bytes at offset {} into zone with size {}",
+            size, offset, zone.size());
+    return false;
+  }
+
+  InterruptDisabler disabler;
+  ZonePin pin(zone);
+  PhysicalAddress pages[FIXMAP_BATCH];
+  for (size_t done = 0; done < size;) {
+    const size_t first = (offset + done) / PAGE_SIZE;
+    const size_t start = (offset + done) % PAGE_SIZE;
+    const size_t pages_left = Core::ceil_div(start + size - done, PAGE_SIZE);
+    const size_t count = min<size_t>(FIXMAP_BATCH, pages_left);
+    const size_t length = min(count * PAGE_SIZE - start, size - done);
+
+    u32 fresh;
+    if (!collect_zone_pages(zone, first, count, pages, fresh)) {
+      errorln("[MM] out of physical pages for zone");
+      return false;
+    }
+    u8 *window = map_temporary(pages, count);
+    ASSERT(window);
+    for (size_t i = 0; i < count; i++) {
+      if (!(fresh & (1u << i)))
+        continue;
+      const size_t page_start = i * PAGE_SIZE;
+      const size_t page_end = page_start + PAGE_SIZE;
+      if (start > page_start)
+        memset(window + page_start, 0, min(start, page_end) - page_start);
+      if (start + length < page_end) {
+        const size_t from = max(start + length, page_start);
+        memset(window + from, 0, page_end - from);
+      }
+    }
+    callback(window + start, done, length);
+    unmap_temporary(window, count);
+    done += length;
+  }
+  return true;
+}
+
+bool MemoryManager::copy_to_zone(Zone &zone, const size_t offset,
+                                 const void *data, const size_t size) {
+  const auto *bytes = static_cast<const u8 *>(data);
+  return for_each_zone_chunk(
+      zone, offset, size,
+      [&](u8 *dest, const size_t done, const size_t length) {
+        memcpy(dest, bytes + done, length);
+      });
+}
+
+bool MemoryManager::fill_zone(Zone &zone, const size_t offset, const u8 value,
+                              const size_t size) {
+  return for_each_zone_chunk(
+      zone, offset, size, [&](u8 *dest, size_t, const size_t length) {
+        memset(dest, value, length);
+      });
+}
+
+void MemoryManager::zero_zone(Zone &zone) {
+  InterruptDisabler disabler;
+  note_zone_write(zone, 0, zone.m_pages.size());
+  PhysicalAddress pages[FIXMAP_BATCH];
+  size_t count = 0;
+  auto flush = [&] {
+    u8 *window = map_temporary(pages, count);
+    ASSERT(window);
+    memset(window, 0, count * PAGE_SIZE);
+    unmap_temporary(window, count);
+    count = 0;
+  };
+
+  for (size_t i = 0; i < zone.m_pages.size(); i++) {
+    if (is_swapped(zone, i)) {
+      free_swap_slot(zone.m_swap_slots.at(i));
+      zone.m_swap_slots.at(i) = 0;
+    }
+    const PhysicalAddress page = zone.m_pages.at(i);
+    if (!page.get())
+      continue;
+    pages[count++] = page;
+    if (count == FIXMAP_BATCH)
+      flush();
+  }
+  if (count)
+    flush();
+}
+
+// Copies `src` page by page into `dest`, which gets frames for all of it.
+bool MemoryManager::copy_zone(Zone &dest, Zone &src) {
+  ASSERT(dest.m_pages.size() >= src.m_pages.size());
+  constexpr size_t batch = FIXMAP_BATCH / 2;
+
+  InterruptDisabler disabler;
+  ZonePin dest_pin(dest), src_pin(src);
+  PhysicalAddress from[batch], to[batch];
+  for (size_t first = 0; first < src.m_pages.size(); first += batch) {
+    const size_t count = min(batch, src.m_pages.size() - first);
+    u32 fresh;
+    if (!collect_zone_pages(dest, first, count, to, fresh)) {
+      errorln("[MM] copy_zone: out of physical pages");
+      return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+      if (is_swapped(src, first + i) && !swap_in(src, first + i).get()) {
+        errorln("[MM] copy_zone: out of physical pages");
+        return false;
+      }
+      const PhysicalAddress page = src.m_pages.at(first + i);
+      from[i] = page.get() ? page : m_zero_page;
+    }
+
+    u8 *source = map_temporary(from, count);
+    u8 *target = map_temporary(to, count);
+    ASSERT(source && target);
+    memcpy(target, source, count * PAGE_SIZE);
+    unmap_temporary(target, count);
+    unmap_temporary(source, count);
+  }
+  return true;
+}
+
 Vector<PhysicalAddress> MemoryManager::allocate_physical_pages(size_t count) {
   InterruptDisabler disabler;
-  if (count > m_free_pages.size())
+  while (count > m_page_allocator.free_frames() && swap_out_page())
+    ;
+  if (count > m_page_allocator.free_frames())
     return {};
 
   Vector<PhysicalAddress> pages;
   pages.ensure_capacity(count);
-  for (size_t i = 0; i < count; i++)
-    pages.push(m_free_pages.take_last());
+
+  // Prefer one contiguous block; only a fragmented memory falls back to
+  // collecting single frames.
+  const PhysicalAddress base = m_page_allocator.allocate_contiguous(count);
+  for (size_t i = 0; i < count; i++) {
+    if (base.get())
+      pages.push(PhysicalAddress(base.get() + i * PAGE_SIZE));
+    else
+      pages.push(m_page_allocator.allocate(0));
+  }
   return pages;
 }
 
-u8 *MemoryManager::quick_map_one_page(PhysicalAddress addr) {
+PhysicalAddress MemoryManager::allocate_physical_page() {
+  InterruptDisabler disabler;
+  return allocate_frame();
+}
+
+PhysicalAddress MemoryManager::allocate_frame() {
+  for (;;) {
+    PhysicalAddress page = m_page_allocator.allocate(0);
+    // The zeroed frames are the last ones left.
+    if (!page.get() && m_zeroed_page_count)
+      page = m_zeroed_pages[--m_zeroed_page_count];
+    if (page.get() || !swap_out_page())
+      return page;
+  }
+}
+
+PhysicalAddress MemoryManager::take_zeroed_page() {
+  if (!m_zeroed_page_count)
+    return {};
+  m_zeroed_page_hits++;
+  m_zeroing_cycles_saved += m_zeroing_cycles_per_page;
+  return m_zeroed_pages[--m_zeroed_page_count];
+}
+
+void MemoryManager::zero_physical_page(const PhysicalAddress page) {
+  u8 *ptr = map_temporary(page);
+  memset(ptr, 0, PAGE_SIZE);
+  unmap_temporary(ptr);
+}
+
+PhysicalAddress MemoryManager::allocate_zeroed_page() {
+  InterruptDisabler disabler;
+  PhysicalAddress page = take_zeroed_page();
+  if (page.get())
+    return page;
+  m_zeroed_page_misses++;
+  page = allocate_frame();
+  if (page.get())
+    zero_physical_page(page);
+  return page;
+}
+
+bool MemoryManager::zero_idle_pages() {
+  for (size_t i = 0; i < ZEROED_PAGE_BATCH; i++) {
+    InterruptDisabler disabler;
+    // Some free frames stay uncleared for allocations that overwrite them.
+    if (m_zeroed_page_count == ZEROED_PAGE_POOL_SIZE ||
+        m_page_allocator.free_frames() <= ZEROED_PAGE_POOL_SIZE)
+      return false;
+    const PhysicalAddress page = m_page_allocator.allocate(0);
+    ASSERT(page.get());
+
+    const u64 start = read_tsc();
+    zero_physical_page(page);
+    const u32 cycles = (u32)(read_tsc() - start);
+    m_zeroing_cycles_per_page =
+        m_zeroing_cycles_per_page
+            ? (m_zeroing_cycles_per_page * 7 + cycles) / 8
+            : cycles;
+    m_zeroed_pages[m_zeroed_page_count++] = page;
+    m_idle_zeroed_pages++;
+  }
+  return true;
+}
+
+void MemoryManager::initialize_swap() {
+  constexpr u32 sectors = SWAP_SIZE / SECTOR_SIZE;
+  const u32 count = Disk::sector_count();
+  // The swap area must stay clear of whatever the start of the disk holds.
+  if (count < 2 * sectors) {
+    errorln("[MM] disk swap disabled: the disk has {} sectors, {} are needed",
+            count, 2 * sectors);
+    return;
+  }
+  m_swap_first_sector = count - sectors;
+  m_swap_bitmap[0] = 1; // slot 0 marks pages that are not swapped out
+  m_swap_ready = true;
+  okln("[MM] swap: {} KiB from sector {}", SWAP_SIZE / KB,
+       m_swap_first_sector);
+}
+
+bool MemoryManager::swap_out_page() {
+  if ((!m_swap_ready || m_swap_used == SWAP_SLOTS - 1) && zram_is_full())
+    return false;
+
+  size_t budget = SWAP_SCAN_LIMIT;
+  Process *process;
+  Process::Region *region;
+  size_t index;
+  while (find_swap_victim(process, region, index, budget)) {
+    if (swap_out(*process, *region, index))
+      return true;
+  }
+  return false;
+}
+
+// Second-chance clock over the pages of every process's anonymous regions,
+// in address order and one process after the other. A page whose mappings
+// were accessed since the last pass loses its accessed bits and is passed
+// over once; the first page found without them is the victim. Each page
+// looked at takes one step of `budget`; once it runs out, the first page that
+// was passed over is taken instead.
+bool MemoryManager::find_swap_victim(Process *&victim,
+                                     Process::Region *&victim_region,
+                                     size_t &victim_index, size_t &budget) {
+  victim = nullptr;
+  for (; budget; budget--) {
+    Process *process = Process::from_pid(m_clock_pid);
+    if (!process) {
+      process = Process::first_process();
+      if (!process)
+        break;
+      m_clock_pid = process->pid();
+      m_clock_laddr = 0;
+    }
+
+    Process::Region *region =
+        process->m_regions.first_where([&](const Process::Region &region) {
+          return region.end().get() > m_clock_laddr;
+        });
+    if (!region) {
+      Process *next = process->next();
+      m_clock_pid = (next ? next : Process::first_process())->pid();
+      m_clock_laddr = 0;
+      continue;
+    }
+
+    Zone &zone = *region->zone;
+    if (zone.m_swap_slots.is_empty() || zone.m_pinned ||
+        zone.retain_count() > 1) {
+      m_clock_laddr = region->end().get();
+      continue;
+    }
+    m_clock_laddr = max(m_clock_laddr, region->addr.get());
+    const size_t index = (m_clock_laddr - region->addr.get()) / PAGE_SIZE;
+    m_clock_laddr += PAGE_SIZE;
+    if (index >= zone.m_pages.size())
+      continue;
+    const PhysicalAddress page = zone.m_pages.at(index);
+    if (!page.get() || is_frame_shared(page))
+      continue;
+
+    bool accessed = false, large = false;
+    for_each_mapping(*process, *region, index, [&](const LinearAddress laddr) {
+      u32 *entry = find_pte(process->m_page_directory, laddr);
+      if (!entry) {
+        // Part of a 4 MiB mapping, or not mapped at all.
+        large |= PageDirectoryEntry(
+                     &process->m_page_directory[laddr.get() >> 22])
+                     .is_large();
+        return;
+      }
+      const auto pte = PageTableEntry(entry);
+      if (pte.is_accessed()) {
+        accessed = true;
+        pte.set_accessed(false);
+        flush_tlb(*process, laddr);
+      }
+    });
+    if (large || (accessed && victim))
+      continue;
+    victim = process;
+    victim_region = region;
+    victim_index = index;
+    if (!accessed) {
+      budget--;
+      return true;
+    }
+  }
+  return victim != nullptr;
+}
+
+// Runs with interrupts disabled, so only one page is written to the disk at a
+// time; swap_idle_pages() does most of that beforehand.
+bool MemoryManager::swap_out(Process &process, Process::Region &region,
+                             const size_t index) {
+  const PhysicalAddress page = region.zone->m_pages.at(index);
+  // A page that zram keeps as pool storage stays allocated; the next page
+  // it compresses will likely fit next to it.
+  bool consumed = false;
+  u32 slot = zram_store(page, consumed);
+  if (slot) {
+    slot += ZRAM_SLOT_BASE;
+  } else {
+    slot = m_swap_ready ? allocate_swap_slot() : 0;
+    if (!slot)
+      return false;
+    if (!transfer_swap_slot(slot, page, true)) {
+      free_swap_slot(slot);
+      return false;
+    }
+  }
+  finish_swap_out(process, region, index, slot, consumed);
+  return true;
+}
+
+void MemoryManager::finish_swap_out(Process &process, Process::Region &region,
+                                    const size_t index, const u32 slot,
+                                    const bool consumed) {
+  Zone &zone = *region.zone;
+  const PhysicalAddress page = zone.m_pages.at(index);
+  for_each_mapping(process, region, index, [&](const LinearAddress laddr) {
+    u32 *entry = find_pte(process.m_page_directory, laddr);
+    if (!entry || !*entry)
+      return;
+    PageTableEntry(entry).set_swap_slot(slot);
+    flush_tlb(process, laddr);
+  });
+  zone.m_pages.at(index) = PhysicalAddress();
+  zone.m_swap_slots.at(index) = slot;
+  if (!consumed)
+    release_frame(page);
+  m_swap_outs++;
+}
+
+// Picks a page with interrupts disabled, then writes it to the disk as one
+// command with a single cache flush. Its mappings are made read only and clean
+// first; if it was written to, remapped or freed by the time the write is
+// done, it stays where it is.
+bool MemoryManager::swap_idle_pages() {
+  constexpr u16 sectors = PAGE_SIZE / SECTOR_SIZE;
+  Core::RetainPtr<Zone> zone;
+  PhysicalAddress page;
+  pid_t pid;
+  LinearAddress region_addr;
+  size_t index;
+  u32 slot;
+  u8 *ptr;
+  {
+    InterruptDisabler disabler;
+    if (!m_swap_ready || m_swap_used == SWAP_SLOTS - 1 ||
+        m_page_allocator.free_frames() >= SWAP_FREE_TARGET)
+      return false;
+    size_t budget = SWAP_SCAN_LIMIT;
+    Process *process;
+    Process::Region *region;
+    if (!find_swap_victim(process, region, index, budget))
+      return false;
+
+    slot = allocate_swap_slot();
+    zone = *region->zone;
+    page = zone->m_pages.at(index);
+    pid = process->pid();
+    region_addr = region->addr;
+    for_each_mapping(*process, *region, index, [&](const LinearAddress laddr) {
+      u32 *entry = find_pte(process->m_page_directory, laddr);
+      if (!entry || !PageTableEntry(entry).is_present())
+        return;
+      PageTableEntry(entry).set_writable(false);
+      PageTableEntry(entry).set_dirty(false);
+      flush_tlb(*process, laddr);
+    });
+    // Keeps the clock and zram away from the page.
+    zone->m_pinned++;
+    m_writeback_zone = zone.ptr();
+    m_writeback_index = index;
+    m_writeback_dirty = false;
+    ptr = map_temporary(page);
+    ASSERT(ptr);
+  }
+
+  const bool ok = Disk::write_sectors(m_swap_first_sector + slot * sectors,
+                                      sectors, ptr);
+
+  InterruptDisabler disabler;
+  // Dropped while interrupts are still disabled, in case the process let go
+  // of the zone in the meantime.
+  Core::RetainPtr<Zone> retained = Core::move(zone);
+  unmap_temporary(ptr);
+  retained->m_pinned--;
+  m_writeback_zone = nullptr;
+  if (!ok)
+    errorln("[MM] swap: could not write slot {}", slot);
+
+  Process *process = Process::from_pid(pid);
+  Process::Region *region =
+      process ? process->region_containing(region_addr) : nullptr;
+  bool clean = ok && !m_writeback_dirty && region &&
+               region->zone.ptr() == retained.ptr() &&
+               retained->m_pages.at(index).get() == page.get() &&
+               !is_frame_shared(page);
+  if (clean) {
+    for_each_mapping(*process, *region, index, [&](const LinearAddress laddr) {
+      u32 *entry = find_pte(process->m_page_directory, laddr);
+      if (!entry) {
+        clean &= !PageDirectoryEntry(
+                      &process->m_page_directory[laddr.get() >> 22])
+                      .is_large();
+        return;
+      }
+      const auto pte = PageTableEntry(entry);
+      if (pte.is_present() && (pte.is_writable() || pte.is_dirty()))
+        clean = false;
+    });
+  }
+  if (!clean) {
+    // Mappings left read only become writable again on the next write.
+    free_swap_slot(slot);
+    return true;
+  }
+  finish_swap_out(*process, *region, index, slot, false);
+  return true;
+}
+
+void MemoryManager::note_zone_write(const Zone &zone, const size_t first,
+                                    const size_t count) {
+  if (&zone == m_writeback_zone && m_writeback_index >= first &&
+      m_writeback_index - first < count)
+    m_writeback_dirty = true;
+}
+
+PhysicalAddress MemoryManager::swap_in(Zone &zone, const size_t index) {
+  ZonePin pin(zone);
+  const u32 slot = zone.m_swap_slots.at(index);
+  const PhysicalAddress page = allocate_frame();
+  if (!page.get())
+    return {};
+  if (slot >= ZRAM_SLOT_BASE) {
+    zram_load(slot - ZRAM_SLOT_BASE, page);
+  } else if (!transfer_swap_slot(slot, page, false)) {
+    m_page_allocator.free(page, 0);
+    return {};
+  }
+  free_swap_slot(slot);
+  zone.m_swap_slots.at(index) = 0;
+  zone.m_pages.at(index) = page;
+  m_swap_ins++;
+  return page;
+}
+
+u32 MemoryManager::allocate_swap_slot() {
+  constexpr size_t words = SWAP_SLOTS / 32;
+  for (size_t i = 0; i < words; i++) {
+    const size_t word = (m_swap_hint + i) % words;
+    if (m_swap_bitmap[word] == ~0u)
+      continue;
+    const u32 bit = __builtin_ctz(~m_swap_bitmap[word]);
+    m_swap_bitmap[word] |= 1u << bit;
+    m_swap_hint = word;
+    m_swap_used++;
+    return word * 32 + bit;
+  }
+  return 0;
+}
+
+void MemoryManager::free_swap_slot(const u32 slot) {
+  if (slot >= ZRAM_SLOT_BASE) {
+    zram_free(slot - ZRAM_SLOT_BASE);
+    return;
+  }
+  ASSERT(slot);
+  ASSERT(m_swap_bitmap[slot / 32] & (1u << (slot % 32)));
+  m_swap_bitmap[slot / 32] &= ~(1u << (slot % 32));
+  m_swap_used--;
+}
+
+bool MemoryManager::transfer_swap_slot(const u32 slot,
+                                       const PhysicalAddress page,
+                                       const bool write) {
+  constexpr u16 sectors = PAGE_SIZE / SECTOR_SIZE;
+  const u32 sector = m_swap_first_sector + slot * sectors;
+  u8 *ptr = map_temporary(&page, 1);
+  ASSERT(ptr);
+  const bool ok = write ? Disk::write_sectors(sector, sectors, ptr)
+                        : Disk::read_sectors(sector, sectors, ptr);
+  unmap_temporary(ptr, 1);
+  if (!ok)
+    errorln("[MM] swap: could not {} slot {}", write ? "write" : "read",
+            slot);
+  return ok;
+}
+
+PhysicalAddress MemoryManager::allocate_physical_block(const u8 order) {
+  InterruptDisabler disabler;
+  return m_page_allocator.allocate(order);
+}
+
+void MemoryManager::free_physical_block(const PhysicalAddress addr,
+                                        const u8 order) {
+  InterruptDisabler disabler;
+  m_page_allocator.free(addr, order);
+}
+
+void MemoryManager::dump_physical_memory() const {
+  InterruptDisabler disabler;
+  println("[MM] {} of {} page frames free", free_frames(), m_total_frames);
+  println("[MM] 4 MiB pages: {} MiB kernel, {} MiB user",
+          m_kernel_large_pages * 4, m_user_large_pages * 4);
+  println("[MM] {} user page tables, {} pooled", m_user_page_tables,
+          m_page_table_pool_count);
+  const size_t requests = m_zeroed_page_hits + m_zeroed_page_misses;
+  println("[MM] zeroed pages: {} ready, {} cleared while idle, hit rate "
+          "{}/100, ~{} Kcycles saved",
+          m_zeroed_page_count, m_idle_zeroed_pages,
+          requests ? m_zeroed_page_hits * 100 / requests : 0,
+          (u32)(m_zeroing_cycles_saved >> 10));
+  const u32 seconds = max(system.uptime / TICKS_PER_SECOND, 1u);
+  println("[MM] swap: {}/{} disk slots used, {} pages in ({}/s), {} out ({}/s)",
+          m_swap_used, SWAP_SLOTS, m_swap_ins, m_swap_ins / seconds,
+          m_swap_outs, m_swap_outs / seconds);
+  zram_dump_stats();
+  m_page_allocator.dump();
+}
+
+bool MemoryManager::map_kernel_range(const LinearAddress addr,
+                                     const size_t length) {
+  InterruptDisabler disabler;
+  TLBFlushBatch batch;
+  for (u32 offset = 0; offset < length; offset += PAGE_SIZE) {
+    const PhysicalAddress page = allocate_physical_page();
+    if (!page.get()) {
+      errorln("[MM] map_kernel_range: out of physical pages at L{:x}",
+              addr.offset(offset).get());
+      unmap_kernel_range(addr, offset);
+      return false;
+    }
+
+    const auto laddr = addr.offset(offset);
+    auto pte = ensure_pte(laddr);
+    pte.set_physical_page_base(page.get());
+    pte.set_user_allowed(false);
+    pte.set_present(true);
+    pte.set_writable(true);
+    pte.set_global(true);
+    batch.add(laddr);
+  }
+  return true;
+}
+
+void MemoryManager::unmap_kernel_range(const LinearAddress addr,
+                                       const size_t length) {
+  InterruptDisabler disabler;
+  TLBFlushBatch batch;
+  for (u32 offset = 0; offset < length; offset += PAGE_SIZE) {
+    const auto laddr = addr.offset(offset);
+    auto pte = ensure_pte(laddr);
+    ASSERT(pte.physical_page_base());
+    m_page_allocator.free(
+        PhysicalAddress(reinterpret_cast<u32>(pte.physical_page_base())), 0);
+    pte.set_physical_page_base(0);
+    pte.set_present(false);
+    pte.set_writable(false);
+    batch.add(laddr);
+  }
+}
+
+void MemoryManager::set_kernel_range_present(const LinearAddress addr,
+                                             const size_t length,
+                                             const bool present) {
+  InterruptDisabler disabler;
+  TLBFlushBatch batch;
+  for (u32 offset = 0; offset < length; offset += PAGE_SIZE) {
+    const auto laddr = addr.offset(offset);
+    auto pte = ensure_pte(laddr);
+    ASSERT(pte.physical_page_base());
+    pte.set_present(present);
+    batch.add(laddr);
+  }
+}
+
+// Fixmap slots are unmapped (and invalidated) when they are released, so a
+// new mapping never has a stale TLB entry to flush.
+u8 *MemoryManager::map_temporary(const PhysicalAddress *pages,
+                                 const size_t count) {
   // make sure interrupts are disabled
   ASSERT(!(cpu_flags() & 0x200));
-  auto pte = ensure_pte(LinearAddress(4 * MB));
-  okln("[MM] quickmap {:x} @ {:x} {{pte @ {%p}}}", addr.get(), 4 * MB,
-       pte.ptr());
-  pte.set_physical_page_base(addr.page_base());
-  pte.set_present(true);
-  pte.set_writable(true);
-  flush_tlb(LinearAddress(4 * MB));
-  return reinterpret_cast<u8 *>(4 * MB);
+  ASSERT(count && count < FIXMAP_SLOTS);
+  const u64 run = (1ull << count) - 1;
+  for (u32 slot = 0; slot + count <= FIXMAP_SLOTS; slot++) {
+    if (m_fixmap_used & (run << slot))
+      continue;
+    m_fixmap_used |= run << slot;
+
+    const auto base = LinearAddress(FIXMAP_BASE + slot * PAGE_SIZE);
+    for (size_t i = 0; i < count; i++) {
+      auto pte = ensure_pte(base.offset(i * PAGE_SIZE));
+      pte.set_physical_page_base(pages[i].page_base());
+      pte.set_present(true);
+      pte.set_writable(true);
+    }
+    return reinterpret_cast<u8 *>(base.get());
+  }
+  return nullptr;
+}
+
+void MemoryManager::unmap_temporary(u8 *ptr, const size_t count) {
+  ASSERT(!(cpu_flags() & 0x200));
+  const u32 slot = (reinterpret_cast<u32>(ptr) - FIXMAP_BASE) / PAGE_SIZE;
+  ASSERT(slot + count <= FIXMAP_SLOTS);
+  TLBFlushBatch batch;
+  for (size_t i = 0; i < count; i++) {
+    const auto laddr = LinearAddress(FIXMAP_BASE + (slot + i) * PAGE_SIZE);
+    auto pte = ensure_pte(laddr);
+    pte.set_physical_page_base(0);
+    pte.set_present(false);
+    pte.set_writable(false);
+    batch.add(laddr);
+  }
+  m_fixmap_used &= ~(((1ull << count) - 1) << slot);
 }
 
 void MemoryManager::flush_entire_tlb() {
@@ -184,22 +1499,64 @@ void MemoryManager::flush_entire_tlb() {
                "mov %eax, %cr3\n");
 }
 
+// Reloading CR3 keeps global pages; toggling CR4.PGE drops them as well.
+void MemoryManager::flush_global_tlb() {
+  const u32 cr4 = read_cr4();
+  if (!(cr4 & CR4_PGE)) {
+    flush_entire_tlb();
+    return;
+  }
+  write_cr4(cr4 & ~CR4_PGE);
+  write_cr4(cr4);
+}
+
 void MemoryManager::flush_tlb(LinearAddress addr) {
   asm volatile("invlpg %0" : : "m"(*reinterpret_cast<char *>(addr.get())));
 }
 
+// Only the page directory that is loaded can have stale TLB entries; the
+// others get flushed when CR3 is loaded on the switch to their process.
+void MemoryManager::flush_tlb(const Process &process, LinearAddress addr) {
+  if (&process == s_current)
+    flush_tlb(addr);
+}
+
+MemoryManager::TLBFlushBatch::TLBFlushBatch(const Process &process)
+    : m_active(&process == s_current) {}
+
+void MemoryManager::TLBFlushBatch::add(const LinearAddress laddr) {
+  if (!m_active)
+    return;
+  if (m_count < TLB_FLUSH_BATCH_SIZE)
+    m_pages[m_count++] = laddr;
+  else
+    m_overflowed = true;
+  m_global |= laddr.get() < USER_BASE || laddr.get() >= KERNEL_BASE;
+}
+
+void MemoryManager::TLBFlushBatch::flush() {
+  if (m_overflowed && m_global)
+    flush_global_tlb();
+  else if (m_overflowed)
+    flush_entire_tlb();
+  else
+    for (size_t i = 0; i < m_count; i++)
+      flush_tlb(m_pages[i]);
+  m_count = 0;
+  m_overflowed = m_global = false;
+}
+
 bool MemoryManager::unmap_region(Process &process, Process::Region &region) {
   InterruptDisabler disabler;
+  TLBFlushBatch batch(process);
   auto &zone = *region.zone;
   for (size_t i = 0; i < zone.m_pages.size(); i++) {
     const auto laddr = region.addr.offset(i * PAGE_SIZE);
-    auto pte = ensure_pte(laddr);
-    pte.set_physical_page_base(0);
-    pte.set_present(false);
-    pte.set_writable(false);
-    pte.set_user_allowed(false);
-    flush_tlb(laddr);
+    unmap_user_page(process, laddr);
+    batch.add(laddr);
+#if MM_DEBUG
     okln("[MM] Unmapped L{:x} => P{:x}", laddr, zone.m_pages.at(i).get());
+#endif
   }
 
   return true;
@@ -208,20 +1565,18 @@ bool MemoryManager::unmap_region(Process &process, Process::Region &region) {
 bool MemoryManager::unmap_subregion(Process &process,
                                     Process::Subregion &subregion) {
   InterruptDisabler disabler;
-  auto &region = *subregion.region;
-  auto &zone = *region.zone;
+  TLBFlushBatch batch(process);
+  [[maybe_unused]] auto &zone = *subregion.region->zone;
   const size_t numPages = subregion.size / 4096;
   ASSERT(numPages);
   for (size_t i = 0; i < numPages; ++i) {
     const auto laddr = subregion.addr.offset(i * PAGE_SIZE);
-    auto pte = ensure_pte(laddr);
-    pte.set_physical_page_base(0);
-    pte.set_present(false);
-    pte.set_writable(false);
-    pte.set_user_allowed(false);
-    flush_tlb(laddr);
+    unmap_user_page(process, laddr);
+    batch.add(laddr);
+#if MM_DEBUG
     kprintf("MM: >> Unmapped subregion {} L{:x} => P{:x} <<\n",
             subregion.name.characters(), laddr, zone.m_pages.at(i).get());
+#endif
   }
   return true;
 }
@@ -229,7 +1584,7 @@ bool MemoryManager::unmap_subregion(Process &process,
 bool MemoryManager::unmap_regions_for_process(Process &process) {
   // make sure interrupts are disabled
   ASSERT(!(cpu_flags() & 0x200));
-  for (auto &region : process.m_regions) {
+  for (auto *region : process.m_regions) {
     if (!unmap_region(process, *region))
       return false;
   }
@@ -243,39 +1598,55 @@ bool MemoryManager::unmap_regions_for_process(Process &process) {
 bool MemoryManager::map_subregion(const Process &process,
                                   Process::Subregion &subregion) {
   InterruptDisabler disabler;
+  TLBFlushBatch batch(process);
   auto &region = *subregion.region;
   auto &zone = *region.zone;
+  ZonePin pin(zone);
   const size_t firstPage = subregion.offset / 4096;
   const size_t numPages = subregion.size / 4096;
   ASSERT(numPages);
   for (size_t i = 0; i < numPages; ++i) {
+    // Pages that were never touched get mapped by the fault handler.
+    if (!zone.m_pages.at(firstPage + i).get())
+      continue;
     const auto laddr = subregion.addr.offset(i * PAGE_SIZE);
-    auto pte = ensure_pte(laddr);
-    pte.set_physical_page_base(zone.m_pages.at(firstPage + i).get());
-    pte.set_present(true);
-    pte.set_writable(true);
-    pte.set_user_allowed(!process.is_ring0());
-    flush_tlb(laddr);
+    const PhysicalAddress page = zone.m_pages.at(firstPage + i);
+    map_user_page(process, laddr, page, !is_frame_shared(page));
+    batch.add(laddr);
+#if MM_DEBUG
     kprintf("MM: >> Mapped subregion {} L{:x} => P{:x} ({:u} into region) <<\n",
             subregion.name.characters(), laddr,
             zone.m_pages.at(firstPage + i).get(), subregion.offset);
+#endif
   }
   return true;
 }
 
 bool MemoryManager::map_region(const Process &process, Process::Region &region) {
   InterruptDisabler disabler;
+  TLBFlushBatch batch(process);
   auto &zone = *region.zone;
+  ZonePin pin(zone);
   for (size_t i = 0; i < zone.m_pages.size(); ++i) {
+    // Pages that were never touched get mapped by the fault handler.
+    if (!zone.m_pages.at(i).get())
+      continue;
     const auto laddr = region.addr.offset(i * PAGE_SIZE);
-    auto pte = ensure_pte(laddr);
-    pte.set_physical_page_base(zone.m_pages.at(i).get());
-    pte.set_present(true);
-    pte.set_writable(true);
-    pte.set_user_allowed(!process.is_ring0());
-    flush_tlb(laddr);
+    if (map_zone_large_page(process, zone, i, laddr)) {
+#if MM_DEBUG
+      kprintf("MM: >> Mapped L{:x} => P{:x} (4 MiB) <<\n", laddr,
+              zone.m_pages.at(i).get());
+#endif
+      i += 4 * MB / PAGE_SIZE - 1;
+      continue;
+    }
+    const PhysicalAddress page = zone.m_pages.at(i);
+    map_user_page(process, laddr, page, !is_frame_shared(page));
+    batch.add(laddr);
+#if MM_DEBUG
     kprintf("MM: >> Mapped L{:x} => P{:x} <<\n", laddr,
             zone.m_pages.at(i).get());
+#endif
   }
   return true;
 }
@@ -283,7 +1654,7 @@ bool MemoryManager::map_region(const Process &process, Process::Region &region)
 bool MemoryManager::map_regions_for_process(Process &process) {
   // make sure interrupts are disabled
   ASSERT(!(cpu_flags() & 0x200));
-  for (auto &region : process.m_regions) {
+  for (auto *region : process.m_regions) {
     if (!map_region(process, *region))
       return false;
   }
@@ -294,24 +1665,81 @@ bool MemoryManager::map_regions_for_process(Process &process) {
   return true;
 }
 
-bool copy_to_zone(const Zone &zone, const void *data, size_t size) {
-  if (zone.size() < size) {
-    kprintf(
-        "[MM] copy_to_zone: can't fit {:u} bytes into zone with size {:u}\n",
-        size, zone.size());
-    return false;
-  }
+#if MM_SWITCH_BENCHMARK
+// Compares what a context switch used to cost, rewriting the PTEs of the
+// outgoing and the incoming process's regions, with loading CR3.
+void MemoryManager::benchmark_context_switch() {
+  static constexpr size_t sizes[] = {4 * KB, 64 * KB, 256 * KB, 1 * MB};
+  static constexpr size_t rounds = 16;
 
-  InterruptDisabler disabler;
-  auto *dataptr = static_cast<const u8 *>(data);
-  size_t remaining = size;
-  for (const auto i : zone.pages()) {
-    u8 *dest = MM.quick_map_one_page(i);
-    kprintf("memcpy(%p, %p, %u)\n", dest, dataptr, min(PAGE_SIZE, remaining));
-    memcpy(dest, dataptr, min(PAGE_SIZE, remaining));
-    dataptr += PAGE_SIZE;
-    remaining -= PAGE_SIZE;
+  okln("[MM] context switch benchmark: {} switches per region size", rounds);
+  u32 *page_directory = create_page_directory();
+  for (const size_t size : sizes) {
+    InterruptDisabler disabler;
+    Core::RetainPtr<Zone> zone = create_zone(size);
+    if (!zone)
+      break;
+
+    load_page_directory(page_directory);
+    auto remap = [&](const bool present) {
+      for (size_t i = 0; i < zone->m_pages.size(); i++) {
+        const auto laddr = LinearAddress(USER_BASE).offset(i * PAGE_SIZE);
+        auto pte = ensure_pte(page_directory, laddr);
+        pte.set_physical_page_base(present ? zone->m_pages.at(i).get() : 0);
+        pte.set_present(present);
+        pte.set_writable(present);
+        flush_tlb(laddr);
+      }
+    };
+
+    u64 start = read_tsc();
+    for (size_t round = 0; round < rounds; round++) {
+      remap(false);
+      remap(true);
+    }
+    const u32 remap_cycles = (u32)(read_tsc() - start);
+
+    start = read_tsc();
+    for (size_t round = 0; round < rounds; round++) {
+      load_page_directory(m_page_directory);
+      load_page_directory(page_directory);
+    }
+    const u32 cr3_cycles = (u32)(read_tsc() - start);
+    load_page_directory(m_page_directory);
+
+    okln("[MM]   {} KiB region: remap {} cycles/switch, cr3 {} cycles/switch",
+         size / KB, remap_cycles / rounds, cr3_cycles / (rounds * 2));
   }
+  release_page_directory(page_directory);
+}
+#endif
 
-  return true;
-}
\ No newline at end of file
+#if MM_CLONE_BENCHMARK
+// Compares cloning a zone copy-on-write with copying all of its pages, for
+// address spaces of growing size.
+void MemoryManager::benchmark_clone() {
+  static constexpr size_t sizes[] = {64 * KB, 256 * KB, 1 * MB, 4 * MB};
+
+  okln("[MM] clone benchmark");
+  for (const size_t size : sizes) {
+    InterruptDisabler disabler;
+    Core::RetainPtr<Zone> zone = create_zone(size);
+    if (!zone)
+      break;
+
+    u64 start = read_tsc();
+    Core::RetainPtr<Zone> clone = clone_zone(*zone);
+    const u32 clone_cycles = (u32)(read_tsc() - start);
+    clone = nullptr;
+
+    start = read_tsc();
+    Core::RetainPtr<Zone> copy = create_zone(size);
+    if (!copy || !copy_zone(*copy, *zone))
+      break;
+    const u32 copy_cycles = (u32)(read_tsc() - start);
+
+    okln("[MM]   {} KiB: clone {} cycles, copy {} cycles", size / KB,
+         clone_cycles, copy_cycles);
+  }
+}
+#endif
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "BuddyAllocator.hpp"
 #include "Common.hpp"
 #include "Interrupts/Interrupts.hpp"
 #include "LibCore/RetainPtr.hpp"
@@ -10,6 +11,57 @@
 #include <LibCore/Vector.hpp>
 
 class Process;
+struct multiboot_info;
+
+// Linear addresses below USER_BASE, where physical memory is identity mapped,
+// and from KERNEL_BASE up, where the heap lives, are shared by every page
+// directory. The range in between is private to the process that owns the
+// directory.
+#define USER_BASE 0x40000000
+#define KERNEL_BASE KMALLOC_GROW_BASE
+
+// Kernel window for temporary mappings of arbitrary frames: FIXMAP_SLOTS
+// pages from FIXMAP_BASE, handed out in runs of consecutive slots. Bulk zone
+// operations map up to FIXMAP_BATCH zone pages at a time.
+#define FIXMAP_BASE (4 * MB)
+#define FIXMAP_SLOTS 64
+#define FIXMAP_BATCH 16
+
+// Empty page tables, zeroed and ready to use, kept around for ensure_pte();
+// released tables beyond that go back to the frame allocator.
+#define PAGE_TABLE_POOL_SIZE 8
+
+// Free frames the kernel task clears while it idles, so that zone pages can
+// be handed out without zeroing them first. It clears up to
+// ZEROED_PAGE_BATCH of them between checks for something else to do.
+#define ZEROED_PAGE_POOL_SIZE 64
+#define ZEROED_PAGE_BATCH 4
+
+// When frames run out, pages of anonymous zones are compressed into the zram
+// pool, or written to the last SWAP_SIZE bytes of the primary disk if they do
+// not compress. A clock scan over the process regions picks them, giving
+// pages that were accessed since it last came by a second chance.
+#define SWAP_SIZE (16 * MB)
+#define SWAP_SLOTS (SWAP_SIZE / PAGE_SIZE)
+// Swap slots from here on are zram slots.
+#define ZRAM_SLOT_BASE SWAP_SLOTS
+// Pages the clock looks at for one page to swap out; if all of them were
+// accessed, the first one goes anyway.
+#define SWAP_SCAN_LIMIT 256
+// While fewer frames than this are free, the kernel task writes pages to the
+// swap disk when it idles, so that allocations rarely have to.
+#define SWAP_FREE_TARGET 256
+
+// Mapping operations that change more pages than this flush the whole TLB
+// instead of invalidating every page on its own.
+#define TLB_FLUSH_BATCH_SIZE 32
+
+// Log page table allocations, page faults and every page (un)mapped for a
+// region.
+#define MM_DEBUG 0
+
+#define MM_SWITCH_BENCHMARK 0
+#define MM_CLONE_BENCHMARK 0
 
 enum class PageFaultResponse {
   ShouldCrash,
@@ -21,8 +73,14 @@ class Zone : public Core::Retainable<Zone> {
 
 public:
   ~Zone();
+
+  static void *operator new(size_t);
+  static void operator delete(void *);
+  static Core::ObjectPoolStats pool_stats();
+
   size_t size() const { return m_pages.size() * PAGE_SIZE; }
 
+  // Pages of a lazy zone are null until they are first touched.
   const Vector<PhysicalAddress> &pages() const { return m_pages; }
 
 private:
@@ -30,6 +88,12 @@ private:
   explicit Zone(Vector<PhysicalAddress> &&);
 
   Vector<PhysicalAddress> m_pages;
+  // The swap slot of each page that is swapped out, 0 for the others. Only
+  // anonymous zones have slots and can be swapped.
+  Vector<u32> m_swap_slots;
+  // Pinned zones are skipped by the clock scan, while their frames are used
+  // outside of the page tables.
+  u16 m_pinned = 0;
 };
 
 #define MM MemoryManager::instance()
@@ -42,13 +106,49 @@ public:
     return PhysicalAddress(reinterpret_cast<u32>(m_page_directory));
   }
 
-  static void initialize();
+  static void initialize(const multiboot_info &);
+  static bool is_initialized();
+
+  // Sets up the swap area once the disk is known; until then nothing can be
+  // swapped out.
+  void initialize_swap();
+
+  // A page directory for a new process: the kernel page tables are shared and
+  // there are no user mappings yet.
+  u32 *create_page_directory();
+  void release_page_directory(u32 *);
+
+  // Maps `count` frames at consecutive pages of the fixmap window, or returns
+  // null if no run of free slots is that long. Interrupts must be disabled
+  // until the mapping is released again.
+  u8 *map_temporary(const PhysicalAddress *pages, size_t count);
+  u8 *map_temporary(PhysicalAddress page) { return map_temporary(&page, 1); }
+  void unmap_temporary(u8 *, size_t count = 1);
 
-  u8 *quick_map_one_page(PhysicalAddress);
+  bool map_kernel_range(LinearAddress, size_t length);
+  void unmap_kernel_range(LinearAddress, size_t length);
+  void set_kernel_range_present(LinearAddress, size_t length, bool present);
 
-  static PageFaultResponse handle_page_fault(const PageFault &);
+  PageFaultResponse handle_page_fault(const PageFault &);
 
   Core::RetainPtr<Zone> create_zone(size_t);
+  // Reserves `size` bytes worth of pages without allocating any; each page
+  // gets a frame on the first fault in a region that maps it.
+  Core::RetainPtr<Zone> create_lazy_zone(size_t);
+  // Returns the frame backing page `index` of the zone, allocating a zeroed
+  // one if there is none yet or swapping it in, or null if memory is
+  // exhausted.
+  PhysicalAddress commit_zone_page(Zone &, size_t index);
+  // A zone sharing all of this zone's frames copy-on-write. Pages of it that
+  // are swapped out are brought back first.
+  Core::RetainPtr<Zone> clone_zone(Zone &);
+
+  // Bulk zone operations. Pages of a lazy zone get frames as they are written
+  // to; zero_zone() leaves pages without frames alone, they read as zero.
+  bool copy_to_zone(Zone &, size_t offset, const void *data, size_t size);
+  bool fill_zone(Zone &, size_t offset, u8 value, size_t size);
+  void zero_zone(Zone &);
+  bool copy_zone(Zone &dest, Zone &src);
 
   bool map_subregion(const Process &, Process::Subregion &);
   bool unmap_subregion(Process &, Process::Subregion &);
@@ -63,20 +163,155 @@ public:
   void register_zone(Zone &);
   void unregister_zone(Zone &);
 
+  // A frame that is all zeroes, preferably one cleared ahead of time.
+  PhysicalAddress allocate_zeroed_page();
+  // Clears a batch of free frames for allocate_zeroed_page(); returns false
+  // once there is nothing left to clear.
+  bool zero_idle_pages();
+  // Writes a page to the swap disk if free frames are short; returns false
+  // if there was nothing to do.
+  bool swap_idle_pages();
+
+  // Physically contiguous blocks of 2^order page frames, e.g. for DMA.
+  PhysicalAddress allocate_physical_block(u8 order);
+  void free_physical_block(PhysicalAddress, u8 order);
+
+  size_t total_frames() const { return m_total_frames; }
+  // Large pages mapped in the kernel and in all process page directories.
+  size_t kernel_large_pages() const { return m_kernel_large_pages; }
+  size_t user_large_pages() const { return m_user_large_pages; }
+  size_t user_page_tables() const { return m_user_page_tables; }
+  size_t free_frames() const { return m_page_allocator.free_frames(); }
+  void dump_physical_memory() const;
+
+#if MM_SWITCH_BENCHMARK
+  void benchmark_context_switch();
+#endif
+#if MM_CLONE_BENCHMARK
+  void benchmark_clone();
+#endif
+
 private:
-  MemoryManager();
+  explicit MemoryManager(const multiboot_info &);
   ~MemoryManager();
 
+  void initialize_page_frames(const multiboot_info &);
   void initialize_paging();
   static void flush_entire_tlb();
+  static void flush_global_tlb();
   static void flush_tlb(LinearAddress);
+  static void flush_tlb(const Process &, LinearAddress);
+
+  // Keeps the pages of a zone in memory for as long as it is in scope.
+  class ZonePin {
+  public:
+    explicit ZonePin(Zone &zone) : m_zone(zone) { m_zone.m_pinned++; }
+    ~ZonePin() { m_zone.m_pinned--; }
+
+  private:
+    Zone &m_zone;
+  };
+
+  // Gathers the pages a mapping operation changes and invalidates them when
+  // it goes out of scope, or all at once if there are too many of them.
+  class TLBFlushBatch {
+  public:
+    TLBFlushBatch() = default;
+    // Changes to the page directory of a process that is not running need
+    // no invalidation.
+    explicit TLBFlushBatch(const Process &);
+    ~TLBFlushBatch() { flush(); }
+
+    void add(LinearAddress);
+    void flush();
+
+  private:
+    LinearAddress m_pages[TLB_FLUSH_BATCH_SIZE];
+    size_t m_count = 0;
+    bool m_active = true;
+    bool m_overflowed = false;
+    bool m_global = false;
+  };
 
+  Process::Region *region_page_for(Process &, LinearAddress, size_t &index);
+  void remap_zone_page(Process &, const Process::Region &, size_t index);
+  template <typename Callback>
+  void for_each_mapping(const Process &, const Process::Region &,
+                        size_t index, Callback);
+  bool page_in(Process &, LinearAddress, bool write);
+  // True if the page behind `laddr` is stored compressed in zram.
+  bool is_zram_page(Process &, LinearAddress);
+  bool copy_on_write(Process &, LinearAddress);
+
+  void map_large_page(u32 *page_directory, LinearAddress, PhysicalAddress,
+                      bool user_allowed);
+  bool map_zone_large_page(const Process &, const Zone &, size_t index,
+                           LinearAddress);
+
+  bool collect_zone_pages(Zone &, size_t first, size_t count,
+                          PhysicalAddress *pages, u32 &fresh);
+  // Points the present mappings of the zone pages set in `changed`, counted
+  // from `first`, at their current frames in every process. Pages that are
+  // not mapped are left to the fault handler.
+  void remap_zone_pages(const Zone &, size_t first, u32 changed);
+  template <typename Callback>
+  bool for_each_zone_chunk(Zone &, size_t offset, size_t size, Callback);
+
+  // Frames of cloned zones count the zones sharing them beyond the first.
+  bool is_frame_shared(PhysicalAddress);
+  void share_frame(PhysicalAddress);
+  void release_frame(PhysicalAddress);
+
+  // Page tables come zeroed, from the pool if it has any.
   void *allocate_page_table();
+  PageFrame &page_table_frame(const u32 *page_table) {
+    return m_page_allocator.frame_for(
+        PhysicalAddress(reinterpret_cast<u32>(page_table)));
+  }
+  bool grow_page_table_pool();
+  // Takes back a user page table; `zeroed` if none of its entries are set.
+  void release_page_table(u32 *, bool zeroed);
+
+  // Set and clear user PTEs, keeping count of the entries in use (mapped or
+  // holding a swap slot) in each page table; a table whose last entry is
+  // cleared is released.
+  void map_user_page(const Process &, LinearAddress, PhysicalAddress,
+                     bool writable);
+  void unmap_user_page(const Process &, LinearAddress);
+  // The PTE for an address if it has a page table; never allocates one.
+  u32 *find_pte(u32 *page_directory, LinearAddress);
+
+  void make_swappable(Zone &);
+  bool is_swapped(const Zone &zone, const size_t index) const {
+    return !zone.m_swap_slots.is_empty() && zone.m_swap_slots.at(index);
+  }
+  // Advances the clock until a page was swapped out, for at most
+  // SWAP_SCAN_LIMIT pages.
+  bool swap_out_page();
+  bool find_swap_victim(Process *&, Process::Region *&, size_t &index,
+                        size_t &budget);
+  bool swap_out(Process &, Process::Region &, size_t index);
+  // Points the mappings of the page at `slot` and frees its frame.
+  void finish_swap_out(Process &, Process::Region &, size_t index, u32 slot,
+                       bool consumed);
+  // Called before the kernel writes to zone pages [first, first + count);
+  // swap_idle_pages() keeps a page that is written to while it is on the way
+  // to the disk.
+  void note_zone_write(const Zone &, size_t first, size_t count);
+  PhysicalAddress swap_in(Zone &, size_t index);
+  u32 allocate_swap_slot();
+  void free_swap_slot(u32 slot);
+  bool transfer_swap_slot(u32 slot, PhysicalAddress, bool write);
 
   void protect_map(LinearAddress, size_t length);
   void identity_map(LinearAddress, size_t length);
 
   Vector<PhysicalAddress> allocate_physical_pages(size_t count);
+  PhysicalAddress allocate_physical_page();
+  // A free frame, swapping a page out to make room if there is none.
+  PhysicalAddress allocate_frame();
+  PhysicalAddress take_zeroed_page();
+  void zero_physical_page(PhysicalAddress);
 
   struct PageDirectoryEntry {
     explicit PageDirectoryEntry(u32 *pde) : m_pde(pde) {};
@@ -96,6 +331,8 @@ private:
       PRESENT = 1 << 0,
       READ_WRITE = 1 << 1,
       USER_SUPERVISOR = 1 << 2,
+      LARGE_PAGE = 1 << 7,
+      GLOBAL = 1 << 8, // large pages only
     };
 
     bool is_present() const { return raw() & PRESENT; }
@@ -107,7 +344,13 @@ private:
     bool is_writable() const { return raw() & READ_WRITE; }
     void set_writable(const bool b) const { set_bit(READ_WRITE, b); }
 
-    void set_bit(const u8 bit, const bool value) const {
+    // Maps 4 MiB directly instead of pointing at a page table.
+    bool is_large() const { return raw() & LARGE_PAGE; }
+    void set_large(const bool b) const { set_bit(LARGE_PAGE, b); }
+
+    void set_global(const bool b) const { set_bit(GLOBAL, b); }
+
+    void set_bit(const u16 bit, const bool value) const {
       if (value)
         *m_pde |= bit;
       else
@@ -135,6 +378,10 @@ private:
       PRESENT = 1 << 0,
       READ_WRITE = 1 << 1,
       USER_SUPERVISOR = 1 << 2,
+      ACCESSED = 1 << 5,
+      DIRTY = 1 << 6,
+      GLOBAL = 1 << 8,
+      SWAPPED = 1 << 9, // not present, the page base holds the swap slot
     };
 
     bool is_present() const { return raw() & PRESENT; }
@@ -146,7 +393,22 @@ private:
     bool is_writable() const { return raw() & READ_WRITE; }
     void set_writable(const bool b) const { set_bit(READ_WRITE, b); }
 
-    void set_bit(const u8 bit, const bool value) const {
+    // Survives CR3 loads; only used for kernel mappings, which every page
+    // directory shares.
+    void set_global(const bool b) const { set_bit(GLOBAL, b); }
+
+    // Set by the CPU whenever the page is used.
+    bool is_accessed() const { return raw() & ACCESSED; }
+    void set_accessed(const bool b) const { set_bit(ACCESSED, b); }
+
+    // Set by the CPU whenever the page is written to.
+    bool is_dirty() const { return raw() & DIRTY; }
+    void set_dirty(const bool b) const { set_bit(DIRTY, b); }
+
+    bool is_swapped() const { return raw() & SWAPPED; }
+    void set_swap_slot(const u32 slot) const { *m_pte = slot << 12 | SWAPPED; }
+
+    void set_bit(const u16 bit, const bool value) const {
       if (value)
         *m_pte |= bit;
       else
@@ -156,9 +418,44 @@ private:
     u32 *m_pte;
   };
 
-  PageTableEntry ensure_pte(LinearAddress);
+  // Splits a large page covering `addr` into 4 KiB pages.
+  PageTableEntry ensure_pte(u32 *page_directory, LinearAddress);
+  PageTableEntry ensure_pte(const LinearAddress addr) {
+    return ensure_pte(m_page_directory, addr);
+  }
 
   u32 *m_page_directory, *m_page_table_zero, *m_page_table_one;
+  size_t m_process_page_directories = 0;
+  // Mapped read only wherever a zone page that was never written is read.
+  PhysicalAddress m_zero_page;
+  bool m_has_pse = false, m_has_pge = false;
+  u64 m_fixmap_used = 0;
+  size_t m_kernel_large_pages = 0, m_user_large_pages = 0;
+  size_t m_user_page_tables = 0;
+  u32 *m_page_table_pool[PAGE_TABLE_POOL_SIZE] = {};
+  size_t m_page_table_pool_count = 0;
+  PhysicalAddress m_zeroed_pages[ZEROED_PAGE_POOL_SIZE];
+  size_t m_zeroed_page_count = 0;
+  size_t m_zeroed_page_hits = 0, m_zeroed_page_misses = 0;
+  size_t m_idle_zeroed_pages = 0;
+  // Running average of what clearing a frame costs, and the cycles the hits
+  // did not have to spend on it.
+  u32 m_zeroing_cycles_per_page = 0;
+  u64 m_zeroing_cycles_saved = 0;
+  bool m_swap_ready = false;
+  u32 m_swap_first_sector = 0;
+  u32 m_swap_bitmap[SWAP_SLOTS / 32] = {};
+  size_t m_swap_used = 0, m_swap_hint = 0;
+  size_t m_swap_ins = 0, m_swap_outs = 0;
+  // Where the clock scan resumes: a process and an address in it.
+  pid_t m_clock_pid = 0;
+  u32 m_clock_laddr = 0;
+  // The page swap_idle_pages() is writing out, and whether it was written
+  // to through the kernel since.
+  const Zone *m_writeback_zone = nullptr;
+  size_t m_writeback_index = 0;
+  bool m_writeback_dirty = false;
   HashTable<Zone *> m_zones;
-  Vector<PhysicalAddress> m_free_pages;
+  BuddyAllocator m_page_allocator;
+  size_t m_total_frames = 0;
 };
\ No newline at end of file
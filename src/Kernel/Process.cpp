@@ -11,6 +11,8 @@
 #include <LibCore/Types.hpp>
 
 static constexpr u32 DEFAULT_STACK_SIZE = 16384;
+// Unmapped space kept on either side of a region placed by allocate_region().
+static constexpr u32 REGION_GUARD_SIZE = 16384;
 
 Process *s_current;
 Process *s_kernel_process;
@@ -20,6 +22,59 @@ static InlineLinkedList<Process> *s_processes;
 static InlineLinkedList<Process> *s_dead_process;
 static String *s_hostname;
 
+static Core::ObjectPool<Process, InterruptDisabler> s_process_pool;
+static Core::ObjectPool<Process::Region, InterruptDisabler> s_region_pool;
+static Core::ObjectPool<Process::Subregion, InterruptDisabler> s_subregion_pool;
+
+void *Process::operator new(size_t size) {
+  ASSERT(size == sizeof(Process));
+  return s_process_pool.allocate();
+}
+
+void Process::operator delete(void *ptr) { s_process_pool.deallocate(ptr); }
+
+Core::ObjectPoolStats Process::pool_stats() { return s_process_pool.stats(); }
+
+void *Process::Region::operator new(size_t size) {
+  ASSERT(size == sizeof(Region));
+  return s_region_pool.allocate();
+}
+
+void Process::Region::operator delete(void *ptr) {
+  s_region_pool.deallocate(ptr);
+}
+
+Core::ObjectPoolStats Process::Region::pool_stats() {
+  return s_region_pool.stats();
+}
+
+void *Process::Subregion::operator new(size_t size) {
+  ASSERT(size == sizeof(Subregion));
+  return s_subregion_pool.allocate();
+}
+
+void Process::Subregion::operator delete(void *ptr) {
+  s_subregion_pool.deallocate(ptr);
+}
+
+Core::ObjectPoolStats Process::Subregion::pool_stats() {
+  return s_subregion_pool.stats();
+}
+
+static void dump_object_pool(const char *name,
+                             const Core::ObjectPoolStats &stats) {
+  okln("[pool] {}: {} allocations, hit rate {}/100, {} refills, {}/{} in use",
+       name, stats.allocations, stats.hit_rate(), stats.refills,
+       stats.in_use, stats.capacity);
+}
+
+void dump_object_pools() {
+  dump_object_pool("Process", Process::pool_stats());
+  dump_object_pool("Region", Process::Region::pool_stats());
+  dump_object_pool("Subregion", Process::Subregion::pool_stats());
+  dump_object_pool("Zone", Zone::pool_stats());
+}
+
 Vector<Process *> Process::all_processes() {
   InterruptDisabler disabler;
   Vector<Process *> processes;
@@ -30,6 +85,8 @@ Vector<Process *> Process::all_processes() {
   return processes;
 }
 
+Process *Process::first_process() { return s_processes->head(); }
+
 Process *Process::from_pid(const pid_t pid) {
   ASSERT(!(cpu_flags() & 0x200));
   for (auto *process = s_processes->head(); process;
@@ -40,28 +97,106 @@ Process *Process::from_pid(const pid_t pid) {
   return nullptr;
 }
 
+Process::Region *Process::region_containing(const LinearAddress laddr) const {
+  Region *region = m_regions.last_where(
+      [&](const Region &r) { return r.addr.get() <= laddr.get(); });
+  if (!region || laddr.get() >= region->end().get())
+    return nullptr;
+  return region;
+}
+
+// Best fit: the smallest gap between two regions that has room for the
+// region and its guards, unless the space after the last region is smaller
+// still. Returns a null address if nothing fits.
+LinearAddress Process::find_free_range(const usz size) const {
+  const usz needed = size + 2 * REGION_GUARD_SIZE;
+  Region *fit = m_region_gaps.first_where(
+      [&](const Region &r) { return r.gap_before >= needed; });
+
+  Region *last = m_regions.last();
+  const u32 tail_start = last ? last->end().get() : USER_BASE;
+  const usz tail = KERNEL_BASE - tail_start;
+  if (tail >= needed && (!fit || tail < fit->gap_before))
+    return LinearAddress(tail_start + REGION_GUARD_SIZE);
+  if (!fit)
+    return {};
+  return LinearAddress(fit->addr.get() - fit->gap_before + REGION_GUARD_SIZE);
+}
+
+void Process::insert_region(Region &region) {
+  Region *next = m_regions.first_where(
+      [&](const Region &r) { return r.addr.get() > region.addr.get(); });
+  Region *prev = next ? m_regions.prev(*next) : m_regions.last();
+  const u32 start = prev ? prev->end().get() : USER_BASE;
+  region.gap_before = region.addr.get() - start;
+  m_regions.insert(region);
+  m_region_gaps.insert(region);
+
+  if (next) {
+    m_region_gaps.remove(*next);
+    next->gap_before = next->addr.get() - region.end().get();
+    m_region_gaps.insert(*next);
+  }
+}
+
+// Drops the reference the tree held; subregions may keep the region alive.
+void Process::remove_region(Region &region) {
+  Region *prev = m_regions.prev(region);
+  Region *next = m_regions.next(region);
+  m_regions.remove(region);
+  m_region_gaps.remove(region);
+
+  if (next) {
+    m_region_gaps.remove(*next);
+    const u32 start = prev ? prev->end().get() : USER_BASE;
+    next->gap_before = next->addr.get() - start;
+    m_region_gaps.insert(*next);
+  }
+  region.release();
+}
+
 Process::Region *Process::allocate_region(const usz size, String &&name) {
-  Core::RetainPtr<Zone> zone = MM.create_zone(size);
-  ASSERT(zone);
-  m_regions.push(
-      Core::adopt(*new Region(m_next_region, size, move(zone), move(name))));
-  m_next_region = m_next_region.offset(size).offset(16384);
-  return m_regions.last().ptr();
+  InterruptDisabler disabler;
+  const usz pages_size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+  const LinearAddress addr = find_free_range(pages_size);
+  if (!addr.get()) {
+    errorln("[process] {}: no room for a region of {} bytes", m_name, size);
+    return nullptr;
+  }
+  return allocate_region(size, move(name), addr);
 }
 
-Process::Region *Process::allocate_region(usz size, String &&name,
-                                          LinearAddress) {}
+// Fails if the page-aligned range is outside user space or overlaps another
+// region.
+Process::Region *Process::allocate_region(const usz size, String &&name,
+                                          LinearAddress addr) {
+  InterruptDisabler disabler;
+  const u32 base = addr.page_base();
+  const usz pages_size = (addr.get() - base + size + PAGE_SIZE - 1) & PAGE_MASK;
+  if (!size || base < USER_BASE || pages_size > KERNEL_BASE - base)
+    return nullptr;
+
+  Region *prev = m_regions.last_where(
+      [&](const Region &r) { return r.addr.get() < base + pages_size; });
+  if (prev && prev->end().get() > base)
+    return nullptr;
+
+  Core::RetainPtr<Zone> zone = MM.create_lazy_zone(pages_size);
+  ASSERT(zone);
+  auto *region =
+      new Region(LinearAddress(base), pages_size, move(zone), move(name));
+  insert_region(*region);
+  MM.map_region(*this, *region);
+  return region;
+}
 
 bool Process::deallocate_region(Region &region) {
   InterruptDisabler disabler;
-  for (usz i = 0; i < m_regions.size(); i++) {
-    if (m_regions.at(i).ptr() == &region) {
-      MM.unmap_region(*this, region);
-      m_regions.remove(i);
-      return true;
-    }
-  }
-  return false;
+  if (region_containing(region.addr) != &region)
+    return false;
+  MM.unmap_region(*this, region);
+  remove_region(region);
+  return true;
 }
 
 Process *Process::create_kernel_process(void (*entry)(), String &&name) {
@@ -94,8 +229,6 @@ Process::Process(String &&name, uid_t uid, gid_t gid, pid_t parent_pid,
     // m_cwd = nullptr;
   }
 
-  m_next_region = LinearAddress(0x600000);
-
   memset(&m_tss, 0, sizeof(m_tss));
 
   if (is_ring3()) {
@@ -116,7 +249,9 @@ Process::Process(String &&name, uid_t uid, gid_t gid, pid_t parent_pid,
   m_tss.ss = ss;
   m_tss.cs = cs;
 
-  m_tss.cr3 = MM.page_directory_base().get();
+  // The task switch into this process loads its page directory.
+  m_page_directory = MM.create_page_directory();
+  m_tss.cr3 = reinterpret_cast<u32>(m_page_directory);
 
   if (is_ring0()) {
     u32 stack_bottom = reinterpret_cast<u32>(kmalloc(DEFAULT_STACK_SIZE));
@@ -152,6 +287,12 @@ Process::~Process() {
     kfree(m_kernel_stack);
     m_kernel_stack = nullptr;
   }
+
+  while (Region *region = m_regions.first())
+    remove_region(*region);
+
+  MM.release_page_directory(m_page_directory);
+  m_page_directory = nullptr;
 }
 
 #if PROCESS_CHECK_SANITY
@@ -204,7 +345,7 @@ void Process::initialize() {
 void Process::dump_regions() {
   okln("Process {}({}) regions:", name(), pid());
   okln("BEGIN       END         SIZE        NAME");
-  for (auto &region : m_regions) {
+  for (auto *region : m_regions) {
     okln("{:x} -- {:x}    {:x}    {}", region->addr.get(),
          region->addr.offset(region->size - 1).get(), region->size,
          region->name);
@@ -360,16 +501,8 @@ bool context_switch(Process *process) {
     ASSERT(cs_rpl == ss_rpl);
   }
 
-  if (s_current) {
-    if (s_current->state() == Process::RUNNING)
-      s_current->set_state(Process::RUNNABLE);
-
-    const bool success = MM.unmap_regions_for_process(*s_current);
-    ASSERT(success);
-  }
-
-  const bool success = MM.map_regions_for_process(*process);
-  ASSERT(success);
+  if (s_current && s_current->state() == Process::RUNNING)
+    s_current->set_state(Process::RUNNABLE);
 
   s_current = process;
   process->set_state(Process::RUNNING);
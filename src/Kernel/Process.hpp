@@ -3,7 +3,9 @@
 #include "Common.hpp"
 #include "Interrupts/Interrupts.hpp"
 #include "TSS.hpp"
+#include <LibCore/InlineAVLTree.hpp>
 #include <LibCore/InlineLinkedList.hpp>
+#include <LibCore/ObjectPool.hpp>
 #include <LibCore/OwnPtr.hpp>
 #include <LibCore/RetainPtr.hpp>
 #include <LibCore/Retainable.hpp>
@@ -25,12 +27,18 @@ public:
 public:
   ~Process();
 
+  static void *operator new(size_t);
+  static void operator delete(void *);
+  static Core::ObjectPoolStats pool_stats();
+
   static Process *create_kernel_process(void (*entry)(), String &&name);
   static Process *create_user_process(const String &path, uid_t, gid_t,
                                       pid_t parent_pid, int &error,
                                       const char **args = nullptr);
 
   static Vector<Process *> all_processes();
+  // The first process in scheduling order; next() leads to the others.
+  static Process *first_process();
 
 #if PROCESS_CHECK_SANITY
   static void check_sanity(const char *message = nullptr);
@@ -91,7 +99,7 @@ public:
 
   static void initialize();
 
-  const Vector<Core::RetainPtr<Region>> &regions() const { return m_regions; };
+  const auto &regions() const { return m_regions; };
   const Vector<Core::OwnPtr<Subregion>> &subregions() const {
     return m_subregions;
   };
@@ -122,6 +130,7 @@ private:
   FarPtr m_far_ptr;
   State m_state = INVALID;
   TSS32 m_tss;
+  u32 *m_page_directory = nullptr;
   Descriptor *m_ldt_entries = nullptr;
   RingLevel m_ring = RING_0;
   int m_error = 0;
@@ -134,16 +143,46 @@ public:
     Region(LinearAddress, size_t, Core::RetainPtr<Zone> &&, String &&);
     ~Region();
 
+    static void *operator new(size_t);
+    static void operator delete(void *);
+    static Core::ObjectPoolStats pool_stats();
+
+    LinearAddress end() const { return addr.offset(size); }
+
     LinearAddress addr;
     size_t size = 0;
     Core::RetainPtr<Zone> zone;
     String name;
+
+    // Unused address space between the previous region (or USER_BASE) and
+    // this one.
+    size_t gap_before = 0;
+    InlineAVLTreeNode<Region> address_node, gap_node;
+
+    struct ByAddress {
+      static auto &node(Region &region) { return region.address_node; }
+      static bool less(const Region &a, const Region &b) {
+        return a.addr.get() < b.addr.get();
+      }
+    };
+    struct ByGap {
+      static auto &node(Region &region) { return region.gap_node; }
+      static bool less(const Region &a, const Region &b) {
+        if (a.gap_before != b.gap_before)
+          return a.gap_before < b.gap_before;
+        return a.addr.get() < b.addr.get();
+      }
+    };
   };
 
   struct Subregion : Core::Retainable<Subregion> {
     Subregion(Region &, u32 offset, size_t, LinearAddress, String &&);
     ~Subregion();
 
+    static void *operator new(size_t);
+    static void operator delete(void *);
+    static Core::ObjectPoolStats pool_stats();
+
     Core::RetainPtr<Region> region;
     u32 offset;
     size_t size = 0;
@@ -155,14 +194,22 @@ public:
   Region *allocate_region(usz, String &&name, LinearAddress);
   bool deallocate_region(Region &region);
 
+  Region *region_containing(LinearAddress) const;
+
 private:
-  Vector<Core::RetainPtr<Region>> m_regions;
+  LinearAddress find_free_range(usz size) const;
+  void insert_region(Region &);
+  void remove_region(Region &);
+
+  // The regions by address, which hold a reference to each of them, and by
+  // the size of the gap in front of them for best-fit placement.
+  InlineAVLTree<Region, Region::ByAddress> m_regions;
+  InlineAVLTree<Region, Region::ByGap> m_region_gaps;
   Vector<Core::OwnPtr<Subregion>> m_subregions;
-
-  LinearAddress m_next_region;
 };
 
 extern void process_init();
+extern void dump_object_pools();
 extern void yield();
 extern bool schedule_new_process();
 extern void switch_now();
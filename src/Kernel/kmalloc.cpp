@@ -4,126 +4,1242 @@
 
 #include "kmalloc.hpp"
 #include "Interrupts/Interrupts.hpp"
+#include "MemoryManager.hpp"
 #include "kprintf.hpp"
+#include "vmalloc.hpp"
 #include <LibC/string.h>
 #include <LibCore/Defines.hpp>
 
-struct PACKED Allocation {
-  size_t start, nchunk;
+#define POOL_SIZE KMALLOC_POOL_SIZE
+#define POOL_PAGES (POOL_SIZE / PAGE_SIZE)
+
+#define BASE_PHYSICAL KMALLOC_POOL_BASE
+
+// Once the boot pool is full the heap grows by mapping SPAN_SIZE spans of
+// physical pages from the MemoryManager into the grow range, one slot each.
+#define SPAN_SIZE (256 * KB)
+#define SPAN_PAGES (SPAN_SIZE / PAGE_SIZE)
+#define MAX_SPANS (1 + KMALLOC_GROW_SIZE / SPAN_SIZE)
+
+// Small allocations are served from per-size-class slab caches. A slab is one
+// page taken from a span and cut into equally sized objects; its bookkeeping
+// lives out-of-line in the span's slab_pages so the whole page is usable.
+static constexpr size_t s_slab_sizes[] = {16,  32,  64,   128,
+                                          256, 512, 1024, 2048};
+static constexpr size_t SLAB_CLASS_COUNT =
+    sizeof(s_slab_sizes) / sizeof(s_slab_sizes[0]);
+static constexpr size_t SLAB_MAX_SIZE = s_slab_sizes[SLAB_CLASS_COUNT - 1];
+
+struct SlabObject {
+  SlabObject *next;
 };
 
-#define CHUNK_SIZE 32
-#define POOL_SIZE (1024 * 1024)
+// Objects are cut from the page lazily: `carved` is the offset of the first
+// object that was never handed out, so a new slab is ready in constant time.
+struct SlabPage {
+  SlabObject *free_list;
+  SlabPage *prev, *next;
+  u8 *base;
+  u16 in_use;
+  u16 carved;
+  u8 size_class; // index + 1, 0 if the page does not belong to a slab
+};
+
+struct SlabCache {
+  size_t object_size;
+  SlabPage *partial;
+  u32 pages;
+};
+
+// Everything else is carved out of the spans as blocks, kept in segregated
+// free lists (two-level segregated fit): the first level splits sizes into
+// powers of two, the second level splits each of those into SL_COUNT equal
+// classes. A bitmap per level finds a non-empty list that is large enough
+// with two bit scans, and the neighbours of a block are found through its
+// header, so allocating and freeing a block take constant time.
+#define BLOCK_ALIGN 8zu
+#define BLOCK_FREE 1zu
+#define SL_LOG2 4
+#define SL_COUNT (1 << SL_LOG2)
+#define FL_SHIFT (SL_LOG2 + 3)
+#define SMALL_BLOCK_SIZE (1zu << FL_SHIFT)
+#define FL_COUNT (20 - FL_SHIFT + 2) // blocks are smaller than the 1 MiB pool
+
+struct Block {
+  Block *prev_physical;
+  size_t size; // including the header, BLOCK_FREE is kept in bit 0
+  // Only valid while the block is free; a used block's payload starts here.
+  Block *next_free, *prev_free;
+};
+
+static constexpr size_t BLOCK_HEADER = 2 * sizeof(size_t);
+static constexpr size_t MIN_BLOCK_SIZE = sizeof(Block);
+
+// A contiguous piece of the heap. Span 0 is the boot pool; grown spans keep
+// their slab page descriptors at their start. Every span ends in a zero-sized
+// used block, so merging never runs past its end.
+struct HeapSpan {
+  u8 *base;
+  Block *first;
+  Block *sentinel;
+  SlabPage *slab_pages;
+  bool busy; // being mapped or unmapped with interrupts enabled
+};
+
+static constexpr size_t SPAN_RESERVED =
+    (SPAN_PAGES * sizeof(SlabPage) + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+static constexpr size_t SPAN_USABLE = SPAN_SIZE - SPAN_RESERVED - BLOCK_HEADER;
+
+static SlabPage s_pool_slab_pages[POOL_PAGES];
+
+static HeapSpan s_spans[MAX_SPANS];
+static HeapSpan *s_spare_span;
+
+static u32 s_fl_bitmap;
+static u32 s_sl_bitmap[FL_COUNT];
+static Block *s_free_blocks[FL_COUNT][SL_COUNT];
 
-#define BASE_PHYSICAL (3 * MB)
-#define RANGE_SIZE (1 * MB)
+// With g_kmalloc_next_fit, the free rest of the block that was split last.
+static Block *s_rover;
 
-static u8 alloc_map[POOL_SIZE / CHUNK_SIZE / 8];
+static SlabCache s_slab_caches[SLAB_CLASS_COUNT];
 
-volatile size_t sum_alloc = 0, sum_free = POOL_SIZE;
+volatile size_t sum_alloc = 0, sum_free = 0;
 u32 g_kmalloc_call_count, g_kfree_call_count;
 bool g_dump_kmalloc_stacks;
+bool g_kmalloc_next_fit;
+
+// Telemetry that is kept up to date as the heap changes, so that taking a
+// snapshot never has to walk the heap.
+static size_t s_peak_alloc;
+static u32 s_size_histogram[KMALLOC_SIZE_BUCKETS];
+static u32 s_free_runs[KMALLOC_RUN_BUCKETS];
+static u64 s_kmalloc_cycles, s_kfree_cycles;
+static u32 s_kmalloc_max_cycles, s_kfree_max_cycles;
+
+// Interrupts stay off while the heap is modified. Every such section is
+// timed, so the worst case can be held against KMALLOC_LATENCY_BUDGET.
+class HeapSection {
+public:
+  HeapSection(u64 &cycles, u32 &max_cycles)
+      : m_cycles(cycles), m_max_cycles(max_cycles), m_start(read_tsc()) {}
+
+  ~HeapSection() {
+    const u32 elapsed = (u32)(read_tsc() - m_start);
+    m_cycles += elapsed;
+    if (elapsed > m_max_cycles)
+      m_max_cycles = elapsed;
+  }
+
+private:
+  InterruptDisabler m_disabler;
+  u64 &m_cycles;
+  u32 &m_max_cycles;
+  u64 m_start;
+};
+
+static HeapSpan *span_for(const void *ptr) {
+  const size_t addr = (size_t)ptr;
+  if (addr >= BASE_PHYSICAL && addr < BASE_PHYSICAL + POOL_SIZE)
+    return &s_spans[0];
+  if (addr < KMALLOC_GROW_BASE ||
+      addr >= KMALLOC_GROW_BASE + KMALLOC_GROW_SIZE)
+    return nullptr;
+  HeapSpan &span = s_spans[1 + (addr - KMALLOC_GROW_BASE) / SPAN_SIZE];
+  return span.base ? &span : nullptr;
+}
 
 bool is_kmalloc_address(const void *ptr) {
-  return (size_t)ptr >= BASE_PHYSICAL &&
-         (size_t)ptr <= (BASE_PHYSICAL + POOL_SIZE);
+  if (is_vmalloc_address(ptr))
+    return true;
+#if KMALLOC_GUARD_PAGES
+  if (kmalloc_guard_contains((u32)ptr))
+    return true;
+#endif
+  return span_for(ptr);
+}
+
+static size_t size_bucket(size_t size) {
+  if (size <= 16)
+    return 0;
+  const size_t bucket = 32 - __builtin_clz(size - 1) - 4;
+  return min<size_t>(bucket, KMALLOC_SIZE_BUCKETS - 1);
+}
+
+static size_t run_bucket(size_t size) {
+  return min<size_t>(31 - __builtin_clz(size) - 4, KMALLOC_RUN_BUCKETS - 1);
+}
+
+static size_t block_size(const Block *block) {
+  return block->size & ~BLOCK_FREE;
+}
+
+static bool block_is_free(const Block *block) {
+  return block->size & BLOCK_FREE;
+}
+
+static Block *next_physical(const Block *block) {
+  return (Block *)((u8 *)block + block_size(block));
+}
+
+static u8 *block_payload(Block *block) { return (u8 *)block + BLOCK_HEADER; }
+
+static Block *block_for(const void *ptr) {
+  return (Block *)((u8 *)ptr - BLOCK_HEADER);
+}
+
+static void block_class(size_t size, size_t &fl, size_t &sl) {
+  if (size < SMALL_BLOCK_SIZE) {
+    fl = 0;
+    sl = size / (SMALL_BLOCK_SIZE / SL_COUNT);
+    return;
+  }
+  const size_t bit = 31 - __builtin_clz(size);
+  fl = bit - FL_SHIFT + 1;
+  sl = (size >> (bit - SL_LOG2)) ^ SL_COUNT;
+}
+
+static void insert_free_block(Block *block) {
+  size_t fl, sl;
+  const size_t size = block_size(block);
+  block_class(size, fl, sl);
+
+  Block *&head = s_free_blocks[fl][sl];
+  block->size = size | BLOCK_FREE;
+  block->prev_free = nullptr;
+  block->next_free = head;
+  if (head)
+    head->prev_free = block;
+  head = block;
+  s_fl_bitmap |= 1u << fl;
+  s_sl_bitmap[fl] |= 1u << sl;
+
+  s_free_runs[run_bucket(size)]++;
+  sum_free += size;
+}
+
+static void remove_free_block(Block *block) {
+  size_t fl, sl;
+  const size_t size = block_size(block);
+  block_class(size, fl, sl);
+
+  if (block->prev_free)
+    block->prev_free->next_free = block->next_free;
+  else
+    s_free_blocks[fl][sl] = block->next_free;
+  if (block->next_free)
+    block->next_free->prev_free = block->prev_free;
+  if (!s_free_blocks[fl][sl]) {
+    s_sl_bitmap[fl] &= ~(1u << sl);
+    if (!s_sl_bitmap[fl])
+      s_fl_bitmap &= ~(1u << fl);
+  }
+  block->size = size;
+  if (block == s_rover)
+    s_rover = nullptr;
+
+  s_free_runs[run_bucket(size)]--;
+  sum_free -= size;
+}
+
+// Returns a free block of at least `size` bytes. The size is rounded up to
+// the next class first, so that any block on the list found is large enough.
+// Failing that, the head of the list `size` itself falls into is tried, which
+// lets a fresh span serve a request close to the span size.
+static Block *find_free_block(size_t size) {
+  size_t fl, sl;
+  block_class(size, fl, sl);
+  Block *exact = fl < FL_COUNT ? s_free_blocks[fl][sl] : nullptr;
+
+  if (size >= SMALL_BLOCK_SIZE) {
+    const size_t bit = 31 - __builtin_clz(size);
+    block_class(size + (1zu << (bit - SL_LOG2)) - 1, fl, sl);
+  }
+  if (fl < FL_COUNT) {
+    u32 sl_map = s_sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+      const u32 fl_map = s_fl_bitmap & (~0u << fl << 1);
+      if (fl_map) {
+        fl = __builtin_ctz(fl_map);
+        sl_map = s_sl_bitmap[fl];
+      }
+    }
+    if (sl_map)
+      return s_free_blocks[fl][__builtin_ctz(sl_map)];
+  }
+  return exact && block_size(exact) >= size ? exact : nullptr;
+}
+
+static void account_used(size_t size) {
+  sum_alloc += size;
+  if (sum_alloc > s_peak_alloc)
+    s_peak_alloc = sum_alloc;
+}
+
+// Gives everything behind the first `size` bytes of a used block back to the
+// free lists, merged with the block after it if that one is free too.
+static void trim_block(Block *block, size_t size) {
+  const size_t rest_size = block_size(block) - size;
+  if (rest_size < MIN_BLOCK_SIZE)
+    return;
+
+  auto *rest = (Block *)((u8 *)block + size);
+  rest->prev_physical = block;
+  rest->size = rest_size;
+  block->size = size;
+  sum_alloc -= rest_size;
+
+  Block *next = next_physical(rest);
+  if (block_is_free(next)) {
+    remove_free_block(next);
+    rest->size += block_size(next);
+  }
+  next_physical(rest)->prev_physical = rest;
+  insert_free_block(rest);
+  s_rover = rest;
+}
+
+static size_t block_size_for(size_t size) {
+  const size_t needed = (size + BLOCK_HEADER + BLOCK_ALIGN - 1) &
+                        ~(BLOCK_ALIGN - 1);
+  return max(needed, MIN_BLOCK_SIZE);
+}
+
+// The block search for an `alignment` above BLOCK_ALIGN asks for enough room
+// to move the payload up to the next boundary, with the part in front of it
+// large enough to go back to the free lists as a block of its own.
+static size_t block_search_size(size_t size, size_t alignment) {
+  const size_t needed = block_size_for(size);
+  return alignment > BLOCK_ALIGN ? needed + alignment + MIN_BLOCK_SIZE
+                                 : needed;
+}
+
+static void *block_alloc(size_t size, size_t alignment) {
+  const size_t needed = block_size_for(size);
+  const size_t search = block_search_size(size, alignment);
+  Block *block =
+      g_kmalloc_next_fit && s_rover && block_size(s_rover) >= search
+          ? s_rover
+          : find_free_block(search);
+  if (!block)
+    return nullptr;
+  remove_free_block(block);
+
+  if (alignment > BLOCK_ALIGN) {
+    const size_t payload = (size_t)block_payload(block);
+    size_t gap = ((payload + alignment - 1) & ~(alignment - 1)) - payload;
+    if (gap && gap < MIN_BLOCK_SIZE)
+      gap += alignment;
+    if (gap) {
+      auto *aligned = (Block *)((u8 *)block + gap);
+      aligned->prev_physical = block;
+      aligned->size = block_size(block) - gap;
+      next_physical(aligned)->prev_physical = aligned;
+      block->size = gap;
+      insert_free_block(block);
+      block = aligned;
+    }
+  }
+
+  account_used(block_size(block));
+  trim_block(block, needed);
+#if KMALLOC_POISON
+  memset(block_payload(block), 0xbb, size);
+#endif
+  return block_payload(block);
+}
+
+static bool span_is_empty(const HeapSpan &span) {
+  return block_is_free(span.first) &&
+         next_physical(span.first) == span.sentinel;
+}
+
+// Detaches a grown span that became completely free from the heap, so that
+// the caller can hand it back to the MemoryManager once interrupts are on
+// again. One empty span is kept as a spare so a workload hovering around a
+// span boundary does not map and unmap it over and over.
+static HeapSpan *maybe_release_span(HeapSpan &span) {
+  if (&span == &s_spans[0] || !span_is_empty(span))
+    return nullptr;
+  if (!s_spare_span || s_spare_span == &span || !s_spare_span->base ||
+      !span_is_empty(*s_spare_span)) {
+    s_spare_span = &span;
+    return nullptr;
+  }
+
+  remove_free_block(span.first);
+  sum_alloc -= SPAN_SIZE - SPAN_USABLE;
+  span.base = nullptr;
+  span.busy = true;
+  return &span;
+}
+
+static HeapSpan *block_free(Block *block) {
+  sum_alloc -= block_size(block);
+#if KMALLOC_POISON
+  memset(block_payload(block), 0xaa, block_size(block) - BLOCK_HEADER);
+#endif
+
+  Block *prev = block->prev_physical;
+  if (prev && block_is_free(prev)) {
+    remove_free_block(prev);
+    prev->size += block_size(block);
+    block = prev;
+  }
+  Block *next = next_physical(block);
+  if (block_is_free(next)) {
+    remove_free_block(next);
+    block->size += block_size(next);
+  }
+  next_physical(block)->prev_physical = block;
+  insert_free_block(block);
+  return maybe_release_span(*span_for(block));
+}
+
+// Tries to resize a block where it is: shrinking gives the tail back, growing
+// takes the free block right behind it. Either way takes constant time.
+static bool block_resize(void *ptr, size_t size, size_t &capacity) {
+  Block *block = block_for(ptr);
+  const size_t needed = block_size_for(size);
+  capacity = block_size(block) - BLOCK_HEADER;
+  if (needed <= block_size(block)) {
+    trim_block(block, needed);
+    return true;
+  }
+
+  Block *next = next_physical(block);
+  if (!block_is_free(next) || block_size(block) + block_size(next) < needed)
+    return false;
+  remove_free_block(next);
+  block->size += block_size(next);
+  next_physical(block)->prev_physical = block;
+  account_used(block_size(next));
+  trim_block(block, needed);
+  return true;
+}
+
+static void span_init(HeapSpan &span, u8 *base, size_t size, size_t reserved,
+                      SlabPage *slab_pages) {
+  span.base = base;
+  span.slab_pages = slab_pages;
+  span.first = (Block *)(base + reserved);
+  span.sentinel = (Block *)(base + size - BLOCK_HEADER);
+  span.first->prev_physical = nullptr;
+  span.first->size = (u8 *)span.sentinel - (u8 *)span.first;
+  span.sentinel->prev_physical = span.first;
+  span.sentinel->size = 0;
+
+  account_used(size - block_size(span.first));
+  insert_free_block(span.first);
 }
 
 void kmalloc_init() {
-  memset(&alloc_map, 0, sizeof(alloc_map));
+  memset(&s_pool_slab_pages, 0, sizeof(s_pool_slab_pages));
   memset((void *)BASE_PHYSICAL, 0, POOL_SIZE);
 
+  memset(&s_spans, 0, sizeof(s_spans));
+  memset(&s_free_blocks, 0, sizeof(s_free_blocks));
+  memset(&s_sl_bitmap, 0, sizeof(s_sl_bitmap));
+  s_fl_bitmap = 0;
+  s_spare_span = nullptr;
+  s_rover = nullptr;
+
+  memset(s_size_histogram, 0, sizeof(s_size_histogram));
+  memset(s_free_runs, 0, sizeof(s_free_runs));
+  s_peak_alloc = 0;
+  s_kmalloc_cycles = s_kfree_cycles = 0;
+  s_kmalloc_max_cycles = s_kfree_max_cycles = 0;
+
+  for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+    s_slab_caches[i].object_size = s_slab_sizes[i];
+    s_slab_caches[i].partial = nullptr;
+    s_slab_caches[i].pages = 0;
+  }
+
   sum_alloc = 0;
-  sum_free = POOL_SIZE;
+  sum_free = 0;
+  span_init(s_spans[0], (u8 *)BASE_PHYSICAL, POOL_SIZE, 0,
+            s_pool_slab_pages);
 }
 
-void *kmalloc_aligned(size_t size, size_t alignment) {
-  void *ptr = kmalloc(size + alignment + sizeof(void *));
-  size_t max_addr = (size_t)ptr + alignment;
-  void *aligned_ptr = (void *)(max_addr - (max_addr % alignment));
-  ((void **)aligned_ptr)[-1] = ptr;
-  return aligned_ptr;
+// Maps a new span for an allocation that needs `size` bytes of block. The span
+// is mapped one page per heap section, like vmalloc() does, so interrupts are
+// never off for more than a single page allocation.
+static bool grow_heap(size_t size) {
+  if (!MemoryManager::is_initialized() || size > SPAN_USABLE)
+    return false;
+
+  HeapSpan *span = nullptr;
+  {
+    InterruptDisabler disabler;
+    for (size_t i = 1; i < MAX_SPANS && !span; i++) {
+      if (!s_spans[i].base && !s_spans[i].busy)
+        span = &s_spans[i];
+    }
+    if (!span)
+      return false;
+    span->busy = true;
+  }
+
+  LinearAddress laddr(KMALLOC_GROW_BASE + (span - s_spans - 1) * SPAN_SIZE);
+  for (size_t offset = 0; offset < SPAN_SIZE; offset += PAGE_SIZE) {
+    bool mapped;
+    {
+      HeapSection section(s_kmalloc_cycles, s_kmalloc_max_cycles);
+      mapped = MM.map_kernel_range(laddr.offset(offset), PAGE_SIZE);
+    }
+    if (mapped)
+      continue;
+    for (size_t undo = 0; undo < offset; undo += PAGE_SIZE) {
+      HeapSection section(s_kmalloc_cycles, s_kmalloc_max_cycles);
+      MM.unmap_kernel_range(laddr.offset(undo), PAGE_SIZE);
+    }
+    InterruptDisabler disabler;
+    span->busy = false;
+    return false;
+  }
+  memset(laddr.as_ptr(), 0, SPAN_RESERVED);
+
+  HeapSection section(s_kmalloc_cycles, s_kmalloc_max_cycles);
+  span->busy = false;
+  span_init(*span, laddr.as_ptr(), SPAN_SIZE, SPAN_RESERVED,
+            (SlabPage *)laddr.as_ptr());
+  return true;
 }
 
-void kfree_aligned(void *ptr) { kfree(((void **)ptr)[-1]); }
+static void release_span(HeapSpan &span) {
+  const LinearAddress laddr(KMALLOC_GROW_BASE +
+                            (&span - s_spans - 1) * SPAN_SIZE);
+  for (size_t offset = 0; offset < SPAN_SIZE; offset += PAGE_SIZE) {
+    HeapSection section(s_kfree_cycles, s_kfree_max_cycles);
+    MM.unmap_kernel_range(laddr.offset(offset), PAGE_SIZE);
+  }
 
-void *kmalloc_page_aligned(size_t size) {
-  void *ptr = kmalloc_aligned(size, PAGE_SIZE);
-  auto d = (size_t)ptr;
-  ASSERT((d & PAGE_MASK) == 0);
-  return ptr;
+  InterruptDisabler disabler;
+  span.busy = false;
+}
+
+static size_t largest_free_block() {
+  if (!s_fl_bitmap)
+    return 0;
+  const size_t fl = 31 - __builtin_clz(s_fl_bitmap);
+  const size_t sl = 31 - __builtin_clz(s_sl_bitmap[fl]);
+  size_t largest = 0;
+  for (Block *block = s_free_blocks[fl][sl]; block; block = block->next_free)
+    largest = max(largest, block_size(block));
+  return largest;
 }
 
-void *kmalloc_impl(size_t size) {
+void kmalloc_get_stats(KmallocStats &stats) {
   InterruptDisabler disabler;
-  g_kmalloc_call_count++;
+  stats.bytes_allocated = sum_alloc;
+  stats.bytes_free = sum_free;
+  stats.peak_allocated = s_peak_alloc;
+  stats.largest_free_run = largest_free_block();
+  stats.kmalloc_calls = g_kmalloc_call_count;
+  stats.kfree_calls = g_kfree_call_count;
+  stats.kmalloc_cycles = s_kmalloc_cycles;
+  stats.kfree_cycles = s_kfree_cycles;
+  stats.kmalloc_max_cycles = s_kmalloc_max_cycles;
+  stats.kfree_max_cycles = s_kfree_max_cycles;
+  memcpy(stats.size_histogram, s_size_histogram, sizeof(s_size_histogram));
+  memcpy(stats.free_runs, s_free_runs, sizeof(s_free_runs));
+}
 
-  size_t real_size = size + sizeof(Allocation);
-  if (sum_free < real_size) {
-    PANIC("kmalloc: out of memory");
-    hcf();
+void kmalloc_reset_latency() {
+  InterruptDisabler disabler;
+  s_kmalloc_max_cycles = s_kfree_max_cycles = 0;
+}
+
+u32 kmalloc_fragmentation() {
+  KmallocStats stats;
+  kmalloc_get_stats(stats);
+  if (!stats.bytes_free)
+    return 0;
+  return 1000 - (stats.largest_free_run * 1000) / stats.bytes_free;
+}
+
+void kmalloc_dump_stats() {
+  KmallocStats stats;
+  kmalloc_get_stats(stats);
+
+  println("kmalloc: {} bytes allocated (peak {}), {} free, largest block {}",
+          stats.bytes_allocated, stats.peak_allocated, stats.bytes_free,
+          stats.largest_free_run);
+  println("  {} kmalloc calls, {} cycles each; {} kfree calls, {} cycles each",
+          stats.kmalloc_calls,
+          (u32)stats.kmalloc_cycles / max(stats.kmalloc_calls, 1u),
+          stats.kfree_calls,
+          (u32)stats.kfree_cycles / max(stats.kfree_calls, 1u));
+  println("  interrupts off for at most {} cycles in kmalloc, {} in kfree "
+          "(budget {})",
+          stats.kmalloc_max_cycles, stats.kfree_max_cycles,
+          KMALLOC_LATENCY_BUDGET);
+  if (max(stats.kmalloc_max_cycles, stats.kfree_max_cycles) >
+      KMALLOC_LATENCY_BUDGET)
+    errorln("[kmalloc] interrupt latency budget exceeded");
+  println("  allocation sizes:");
+  for (size_t i = 0; i < KMALLOC_SIZE_BUCKETS; i++) {
+    if (stats.size_histogram[i])
+      println("    <= {}: {}", 16u << i, stats.size_histogram[i]);
   }
+  println("  free blocks:");
+  for (size_t i = 0; i < KMALLOC_RUN_BUCKETS; i++) {
+    if (stats.free_runs[i])
+      println("    {}+ bytes: {}", 16u << i, stats.free_runs[i]);
+  }
+  vmalloc_dump_stats();
+}
+
+static size_t slab_class_for(size_t size) {
+  size_t size_class = 0;
+  while (s_slab_sizes[size_class] < size)
+    size_class++;
+  return size_class;
+}
+
+static SlabPage *page_descriptor_for(const void *ptr) {
+  HeapSpan *span = span_for(ptr);
+  if (!span)
+    return nullptr;
+  return &span->slab_pages[((u8 *)ptr - span->base) / PAGE_SIZE];
+}
+
+static void slab_link(SlabCache &cache, SlabPage &page) {
+  page.prev = nullptr;
+  page.next = cache.partial;
+  if (cache.partial)
+    cache.partial->prev = &page;
+  cache.partial = &page;
+}
+
+static void slab_unlink(SlabCache &cache, SlabPage &page) {
+  if (page.prev)
+    page.prev->next = page.next;
+  else
+    cache.partial = page.next;
+  if (page.next)
+    page.next->prev = page.prev;
+  page.prev = page.next = nullptr;
+}
+
+static bool slab_is_full(const SlabCache &cache, const SlabPage &page) {
+  return !page.free_list && page.carved + cache.object_size > PAGE_SIZE;
+}
 
-  size_t chunks_needed = real_size / CHUNK_SIZE;
-  if (real_size % CHUNK_SIZE)
-    chunks_needed++;
+static SlabPage *slab_grow(SlabCache &cache, size_t size_class) {
+  auto *base = (u8 *)block_alloc(PAGE_SIZE, PAGE_SIZE);
+  if (!base)
+    return nullptr;
 
-  size_t chunks_here = 0, first_chunk = 0;
-  for (size_t i = 0; i < (POOL_SIZE / CHUNK_SIZE / 8); i++) {
-    if (alloc_map[i] == 0xff) {
-      chunks_here = 0;
+  SlabPage &page = *page_descriptor_for(base);
+  page.size_class = size_class + 1;
+  page.base = base;
+  page.in_use = 0;
+  page.carved = 0;
+  page.free_list = nullptr;
+
+  cache.pages++;
+  slab_link(cache, page);
+  return &page;
+}
+
+// Returns nullptr if a new slab page is needed and the heap has to grow.
+static void *slab_alloc(size_t size_class) {
+  SlabCache &cache = s_slab_caches[size_class];
+  SlabPage *page = cache.partial;
+  if (!page)
+    page = slab_grow(cache, size_class);
+  if (!page)
+    return nullptr;
+
+  SlabObject *object = page->free_list;
+  if (object) {
+    page->free_list = object->next;
+  } else {
+    object = (SlabObject *)(page->base + page->carved);
+    page->carved += cache.object_size;
+  }
+  page->in_use++;
+  if (slab_is_full(cache, *page))
+    slab_unlink(cache, *page);
+
+#if KMALLOC_POISON
+  memset(object, 0xbb, cache.object_size);
+#endif
+  return object;
+}
+
+static HeapSpan *slab_free(SlabPage &page, void *ptr) {
+  SlabCache &cache = s_slab_caches[page.size_class - 1];
+#if KMALLOC_POISON
+  memset(ptr, 0xaa, cache.object_size);
+#endif
+
+  // A full page is not on the partial list; it becomes partial again now.
+  if (slab_is_full(cache, page))
+    slab_link(cache, page);
+
+  auto *object = (SlabObject *)ptr;
+  object->next = page.free_list;
+  page.free_list = object;
+  page.in_use--;
+
+  // Keep one empty page per cache around so alloc/free ping-pong on a page
+  // boundary does not keep handing the page back to the free blocks.
+  if (page.in_use == 0 && (page.prev || page.next)) {
+    slab_unlink(cache, page);
+    page.size_class = 0;
+    page.free_list = nullptr;
+    cache.pages--;
+    return block_free(block_for(page.base));
+  }
+  return nullptr;
+}
+
+#if KMALLOC_GUARD_PAGES
+#define GUARD_STACK_DEPTH 8
+#define GUARD_CANARY 0xcc
+
+// Every slot is a data page followed by a guard page that is never mapped.
+struct GuardSlot {
+  u8 *object;
+  size_t size;
+  bool allocated;
+  int alloc_frames, free_frames;
+  u32 alloc_stack[GUARD_STACK_DEPTH];
+  u32 free_stack[GUARD_STACK_DEPTH];
+};
+
+static GuardSlot s_guard_slots[KMALLOC_GUARD_SLOTS];
+static size_t s_guard_next_slot;
+static u32 s_guard_countdown;
+static bool s_guard_ready;
+u32 g_kmalloc_guard_sample_rate = KMALLOC_GUARD_SAMPLE_RATE;
+
+static LinearAddress guard_slot_page(size_t slot) {
+  return LinearAddress(KMALLOC_GUARD_BASE + slot * 2 * PAGE_SIZE);
+}
+
+bool kmalloc_guard_contains(u32 laddr) {
+  return laddr >= KMALLOC_GUARD_BASE &&
+         laddr < KMALLOC_GUARD_BASE + KMALLOC_GUARD_SIZE;
+}
+
+void kmalloc_guard_init() {
+  InterruptDisabler disabler;
+  for (size_t slot = 0; slot < KMALLOC_GUARD_SLOTS; slot++) {
+    if (!MM.map_kernel_range(guard_slot_page(slot), PAGE_SIZE)) {
+      errorln("[kmalloc] guard pages disabled: no memory for slot {}", slot);
+      while (slot--)
+        MM.unmap_kernel_range(guard_slot_page(slot), PAGE_SIZE);
+      return;
+    }
+    MM.set_kernel_range_present(guard_slot_page(slot), PAGE_SIZE, false);
+  }
+  s_guard_countdown = g_kmalloc_guard_sample_rate;
+  s_guard_ready = true;
+}
+
+static void *guard_alloc(size_t size) {
+  if (!s_guard_ready || size > PAGE_SIZE || --s_guard_countdown)
+    return nullptr;
+  s_guard_countdown = g_kmalloc_guard_sample_rate;
+
+  // Hand out slots round-robin so a freed slot stays unmapped for as long as
+  // possible before it is reused.
+  for (size_t i = 0; i < KMALLOC_GUARD_SLOTS; i++) {
+    const size_t index = (s_guard_next_slot + i) % KMALLOC_GUARD_SLOTS;
+    GuardSlot &slot = s_guard_slots[index];
+    if (slot.allocated)
       continue;
+
+    LinearAddress page = guard_slot_page(index);
+    MM.set_kernel_range_present(page, PAGE_SIZE, true);
+    memset(page.as_ptr(), GUARD_CANARY, PAGE_SIZE);
+
+    slot.size = size;
+    slot.object = page.as_ptr() + PAGE_SIZE - ((size + 7) & ~7u);
+    slot.allocated = true;
+    slot.alloc_frames = walk_stack(slot.alloc_stack, GUARD_STACK_DEPTH);
+    slot.free_frames = 0;
+    s_guard_next_slot = index + 1;
+    return slot.object;
+  }
+  return nullptr;
+}
+
+static void guard_report(const GuardSlot &slot) {
+  println("  object {:p}, {} bytes, allocated by:", slot.object, slot.size);
+  print_stack_trace(slot.alloc_stack, slot.alloc_frames);
+  if (slot.free_frames) {
+    println("  freed by:");
+    print_stack_trace(slot.free_stack, slot.free_frames);
+  }
+}
+
+static bool guard_canary_intact(const u8 *from, const u8 *to) {
+  for (const u8 *p = from; p < to; p++) {
+    if (*p != GUARD_CANARY)
+      return false;
+  }
+  return true;
+}
+
+static void guard_free(void *ptr) {
+  const size_t index = ((size_t)ptr - KMALLOC_GUARD_BASE) / (2 * PAGE_SIZE);
+  GuardSlot &slot = s_guard_slots[index];
+  if (!slot.allocated || slot.object != ptr) {
+    if (slot.object)
+      guard_report(slot);
+    PANIC("kfree(): invalid or double free of guarded pointer {:p}", ptr);
+  }
+
+  // The bytes around the object in its page are not protected by the guard
+  // page, so check that nothing scribbled over them.
+  const u8 *page = guard_slot_page(index).as_ptr();
+  if (!guard_canary_intact(page, slot.object) ||
+      !guard_canary_intact(slot.object + slot.size, page + PAGE_SIZE)) {
+    guard_report(slot);
+    PANIC("kfree(): canary around guarded object {:p} was overwritten", ptr);
+  }
+
+  slot.allocated = false;
+  slot.free_frames = walk_stack(slot.free_stack, GUARD_STACK_DEPTH);
+  MM.set_kernel_range_present(guard_slot_page(index), PAGE_SIZE, false);
+}
+
+void kmalloc_guard_report_fault(u32 laddr, bool write) {
+  const size_t page = (laddr - KMALLOC_GUARD_BASE) / PAGE_SIZE;
+  const size_t index = page / 2;
+  println("\033[31;1mkmalloc: invalid {} at {:p} in guarded memory\033[0m",
+          write ? "write" : "read", (void *)laddr);
+
+  if (page % 2 == 0) {
+    // Data pages are only unmapped while their slot is free.
+    println("  use-after-free:");
+    guard_report(s_guard_slots[index]);
+  } else if (s_guard_slots[index].allocated ||
+             index + 1 == KMALLOC_GUARD_SLOTS) {
+    println("  out-of-bounds access past the end:");
+    guard_report(s_guard_slots[index]);
+  } else {
+    println("  out-of-bounds access before the start:");
+    guard_report(s_guard_slots[index + 1]);
+  }
+  PANIC("kmalloc: guard page fault at {:p}", (void *)laddr);
+}
+#endif
+
+// Heap profile, recorded while g_dump_kmalloc_stacks is set. A call site is
+// the function that called into kmalloc plus its caller, so allocations made
+// through operator new or krealloc() are still told apart.
+#define PROFILE_SITES 256
+#define PROFILE_OBJECTS 4096
+#define PROFILE_FRAMES 2
+
+struct ProfileSite {
+  u32 frames[PROFILE_FRAMES];
+  u32 allocations;
+  size_t bytes;
+  size_t live_bytes;
+};
+
+// Live allocations made while profiling, so kfree() can find their site.
+struct ProfileObject {
+  const void *ptr;
+  size_t size;
+  size_t site;
+};
+
+static ProfileSite s_profile_sites[PROFILE_SITES];
+static ProfileObject s_profile_objects[PROFILE_OBJECTS];
+static size_t s_profile_tracked;
+static u32 s_profile_dropped;
+
+static size_t profile_hash(u32 key, size_t buckets) {
+  return ((key * 2654435761u) >> 16) % buckets;
+}
+
+static ProfileObject *profile_object_for(const void *ptr) {
+  size_t index = profile_hash((u32)ptr, PROFILE_OBJECTS);
+  for (size_t probe = 0; probe < PROFILE_OBJECTS; probe++) {
+    ProfileObject &object = s_profile_objects[index];
+    if (object.ptr == ptr || !object.ptr)
+      return &object;
+    index = (index + 1) % PROFILE_OBJECTS;
+  }
+  return nullptr;
+}
+
+[[gnu::noinline]] static void profile_alloc(const void *ptr, size_t size) {
+  // The innermost frame is the kmalloc entry point that called us.
+  u32 frames[PROFILE_FRAMES + 1] = {};
+  walk_stack(frames, PROFILE_FRAMES + 1);
+
+  size_t index = profile_hash(frames[1] ^ (frames[2] * 31), PROFILE_SITES);
+  ProfileSite *site = nullptr;
+  for (size_t probe = 0; probe < PROFILE_SITES && !site; probe++) {
+    ProfileSite &candidate = s_profile_sites[index];
+    if (!candidate.allocations) {
+      candidate.frames[0] = frames[1];
+      candidate.frames[1] = frames[2];
+      site = &candidate;
+    } else if (candidate.frames[0] == frames[1] &&
+               candidate.frames[1] == frames[2]) {
+      site = &candidate;
     }
+    index = (index + 1) % PROFILE_SITES;
+  }
 
-    for (size_t j = 0; j < 8; j++) {
-      if (!(alloc_map[i] & (1 << j))) {
-        if (chunks_here == 0)
-          first_chunk = i * 8 + j;
+  ProfileObject *object = profile_object_for(ptr);
+  if (!site || !object || object->ptr) {
+    s_profile_dropped++;
+    return;
+  }
+  site->allocations++;
+  site->bytes += size;
+  site->live_bytes += size;
+  object->ptr = ptr;
+  object->size = size;
+  object->site = site - s_profile_sites;
+  s_profile_tracked++;
+}
 
-        chunks_here++;
-        if (chunks_here == chunks_needed) {
-          auto *a = (Allocation *)(BASE_PHYSICAL + (first_chunk * CHUNK_SIZE));
-          u8 *ptr = (u8 *)a;
-          ptr += sizeof(Allocation);
-          a->nchunk = chunks_needed;
-          a->start = first_chunk;
+static void profile_resize(const void *ptr, size_t size) {
+  ProfileObject *object = profile_object_for(ptr);
+  if (!object || !object->ptr)
+    return;
+  ProfileSite &site = s_profile_sites[object->site];
+  site.live_bytes = site.live_bytes - object->size + size;
+  object->size = size;
+}
 
-          for (size_t k = first_chunk; k < (first_chunk + chunks_needed); k++)
-            alloc_map[k / 8] |= 1 << (k % 8);
+static void profile_free(const void *ptr) {
+  ProfileObject *object = profile_object_for(ptr);
+  if (!object || !object->ptr)
+    return;
+  s_profile_sites[object->site].live_bytes -= object->size;
+  s_profile_tracked--;
 
-          sum_alloc += a->nchunk * CHUNK_SIZE;
-          sum_free -= a->nchunk * CHUNK_SIZE;
+  // Shift later entries of the probe sequence back into the hole, so lookups
+  // never stop early at an entry that used to be in between.
+  size_t hole = object - s_profile_objects;
+  size_t next = (hole + 1) % PROFILE_OBJECTS;
+  for (; s_profile_objects[next].ptr; next = (next + 1) % PROFILE_OBJECTS) {
+    const size_t home =
+        profile_hash((u32)s_profile_objects[next].ptr, PROFILE_OBJECTS);
+    const bool stays = hole <= next ? (hole < home && home <= next)
+                                    : (hole < home || home <= next);
+    if (stays)
+      continue;
+    s_profile_objects[hole] = s_profile_objects[next];
+    hole = next;
+  }
+  s_profile_objects[hole].ptr = nullptr;
+}
 
-          memset(ptr, 0xbb, (a->nchunk * CHUNK_SIZE) - sizeof(Allocation));
+static void profile_print_frame(const char *prefix, u32 address) {
+  symbol_t symbol;
+  if (get_symbol_containing(&symbol, address))
+    println("{}{}+0x{:x}", prefix, symbol.name, address - symbol.address);
+  else
+    println("{}0x{:x}", prefix, address);
+}
 
-          return ptr;
-        }
-      } else {
-        chunks_here = 0;
+void kmalloc_dump_profile(size_t top) {
+  // The top sites are copied out with interrupts disabled and printed with
+  // them enabled again.
+  static ProfileSite rows[PROFILE_SITES];
+  static bool printed[PROFILE_SITES];
+  top = min<size_t>(top, PROFILE_SITES);
+  size_t count = 0;
+  u32 dropped;
+  {
+    InterruptDisabler disabler;
+    memset(printed, 0, sizeof(printed));
+    for (; count < top; count++) {
+      const ProfileSite *best = nullptr;
+      for (const ProfileSite &site : s_profile_sites) {
+        if (!site.allocations || printed[&site - s_profile_sites])
+          continue;
+        if (!best || site.live_bytes > best->live_bytes ||
+            (site.live_bytes == best->live_bytes && site.bytes > best->bytes))
+          best = &site;
       }
+      if (!best)
+        break;
+      printed[best - s_profile_sites] = true;
+      rows[count] = *best;
     }
+    dropped = s_profile_dropped;
   }
 
-  PANIC("kmalloc(): Out of memory (no suitable block for size {})", size);
-  hcf();
+  // Printing allocates, which must not show up in the profile being printed.
+  const bool was_profiling = g_dump_kmalloc_stacks;
+  g_dump_kmalloc_stacks = false;
+
+  println("kmalloc: top {} call sites by live bytes", top);
+  for (size_t row = 0; row < count; row++) {
+    println("  {} bytes live, {} bytes in {} allocations", rows[row].live_bytes,
+            rows[row].bytes, rows[row].allocations);
+    profile_print_frame("    at ", rows[row].frames[0]);
+    profile_print_frame("    from ", rows[row].frames[1]);
+  }
+  if (dropped)
+    println("  {} allocations were not recorded, the profile is full",
+            dropped);
+  g_dump_kmalloc_stacks = was_profiling;
+}
+
+// Slab objects are aligned to their (power of two) size and blocks can be
+// placed on any boundary, so no alignment needs padding around the object.
+// Page aligned requests still get whole pages.
+static void *heap_try_alloc(size_t size, size_t alignment) {
+  if (alignment >= PAGE_SIZE)
+    return block_alloc((size + PAGE_SIZE - 1) & PAGE_MASK, alignment);
+  if (size <= SLAB_MAX_SIZE && alignment <= SLAB_MAX_SIZE)
+    return slab_alloc(slab_class_for(max(size, alignment)));
+  return block_alloc(size, alignment);
+}
+
+static size_t heap_grow_size(size_t size, size_t alignment) {
+  if (alignment >= PAGE_SIZE)
+    return block_search_size((size + PAGE_SIZE - 1) & PAGE_MASK, alignment);
+  if (size <= SLAB_MAX_SIZE && alignment <= SLAB_MAX_SIZE)
+    return block_search_size(PAGE_SIZE, PAGE_SIZE);
+  return block_search_size(size, alignment);
+}
+
+// Large requests get an area of their own in the vmalloc range instead of
+// tying up heap spans; they only fall back to the heap if that range is full.
+[[gnu::always_inline]] static inline void *large_alloc(size_t size) {
+  void *ptr = vmalloc(size);
+  if (!ptr)
+    return nullptr;
+  HeapSection section(s_kmalloc_cycles, s_kmalloc_max_cycles);
+  g_kmalloc_call_count++;
+  s_size_histogram[size_bucket(size)]++;
+  if (g_dump_kmalloc_stacks)
+    profile_alloc(ptr, size);
+  return ptr;
+}
+
+// Every path through the heap section takes constant time; if the free
+// lists cannot serve the request, the heap grows outside of it and the
+// request is retried. Always inlined so that the profiler sees the kmalloc
+// entry point as the innermost frame.
+[[gnu::always_inline]] static inline void *
+heap_alloc(size_t size, size_t alignment, [[maybe_unused]] bool sampled) {
+  if (size > VMALLOC_THRESHOLD && alignment <= PAGE_SIZE &&
+      MemoryManager::is_initialized()) {
+    if (void *ptr = large_alloc(size))
+      return ptr;
+  }
+  for (;;) {
+    {
+      HeapSection section(s_kmalloc_cycles, s_kmalloc_max_cycles);
+      void *ptr = nullptr;
+#if KMALLOC_GUARD_PAGES
+      if (sampled)
+        ptr = guard_alloc(size);
+#endif
+      if (!ptr)
+        ptr = heap_try_alloc(size, alignment);
+      if (ptr) {
+        g_kmalloc_call_count++;
+        s_size_histogram[size_bucket(size)]++;
+        if (g_dump_kmalloc_stacks)
+          profile_alloc(ptr, size);
+        return ptr;
+      }
+    }
+    if (!grow_heap(heap_grow_size(size, alignment))) {
+      PANIC("kmalloc(): Out of memory (no suitable block for size {})", size);
+      hcf();
+    }
+  }
+}
+
+void *kmalloc_impl(size_t size) { return heap_alloc(size, 0, true); }
+
+void *kmalloc_aligned(size_t size, size_t alignment) {
+  ASSERT(alignment && (alignment & (alignment - 1)) == 0);
+  return heap_alloc(size, alignment, false);
+}
+
+void kfree_aligned(void *ptr) { kfree(ptr); }
+
+void *kmalloc_page_aligned(size_t size) {
+  void *ptr = heap_alloc(size, PAGE_SIZE, false);
+  ASSERT(((size_t)ptr & ~PAGE_MASK) == 0);
+  return ptr;
 }
 
 void kfree(void *ptr) {
   if (!ptr)
     return;
 
-  InterruptDisabler disabler;
-  g_kfree_call_count++;
+  if (is_vmalloc_address(ptr)) {
+    {
+      HeapSection section(s_kfree_cycles, s_kfree_max_cycles);
+      g_kfree_call_count++;
+      if (s_profile_tracked)
+        profile_free(ptr);
+    }
+    vfree(ptr);
+    return;
+  }
+
+  HeapSpan *released = nullptr;
+  {
+    HeapSection section(s_kfree_cycles, s_kfree_max_cycles);
+    g_kfree_call_count++;
+    if (s_profile_tracked)
+      profile_free(ptr);
 
-  auto *a = (Allocation *)((((u8 *)ptr) - sizeof(Allocation)));
-  for (size_t i = a->start; i < (a->start + a->nchunk); i++)
-    alloc_map[i / 8] &= ~(1 << (i % 8));
+#if KMALLOC_GUARD_PAGES
+    if (kmalloc_guard_contains((u32)ptr)) {
+      guard_free(ptr);
+      return;
+    }
+#endif
+
+    SlabPage *page = page_descriptor_for(ptr);
+    if (page && page->size_class)
+      released = slab_free(*page, ptr);
+    else
+      released = block_free(block_for(ptr));
+  }
+  if (released)
+    release_span(*released);
+}
 
-  sum_alloc -= a->nchunk * CHUNK_SIZE;
-  sum_free += a->nchunk * CHUNK_SIZE;
+// Only the in-place attempt runs in a heap section; moving the allocation is
+// a kmalloc(), a copy with interrupts enabled and a kfree().
+void *krealloc(void *ptr, size_t size) {
+  if (!ptr)
+    return kmalloc(size);
+
+  // vmalloc areas are whole pages, which the allocation may grow into.
+  if (is_vmalloc_address(ptr)) {
+    const size_t old_size = vmalloc_size(ptr);
+    if (size <= old_size)
+      return ptr;
+    void *new_ptr = kmalloc(size);
+    memcpy(new_ptr, ptr, old_size);
+    kfree(ptr);
+    return new_ptr;
+  }
+
+  size_t old_size;
+  {
+    HeapSection section(s_kmalloc_cycles, s_kmalloc_max_cycles);
+    bool resized = false;
+    SlabPage *page = page_descriptor_for(ptr);
+    if (!page) {
+#if KMALLOC_GUARD_PAGES
+      ASSERT(kmalloc_guard_contains((u32)ptr));
+      const size_t index =
+          ((size_t)ptr - KMALLOC_GUARD_BASE) / (2 * PAGE_SIZE);
+      old_size = s_guard_slots[index].size;
+#else
+      PANIC("krealloc(): {:p} is not a kmalloc address", ptr);
+#endif
+    } else if (page->size_class) {
+      old_size = s_slab_caches[page->size_class - 1].object_size;
+      resized = size <= old_size;
+    } else {
+      resized = block_resize(ptr, size, old_size);
+    }
+
+    if (resized) {
+      if (s_profile_tracked)
+        profile_resize(ptr, size);
+      return ptr;
+    }
+  }
 
-  memset(a, 0xaa, a->nchunk * CHUNK_SIZE);
+  void *new_ptr = kmalloc(size);
+  memcpy(new_ptr, ptr, min(old_size, size));
+  kfree(ptr);
+  return new_ptr;
+}
+
+#if KMALLOC_BENCHMARK
+void kmalloc_benchmark() {
+  static constexpr size_t sizes[] = {16, 48, 120, 500, 2000};
+  static constexpr size_t batch = 64;
+  static constexpr size_t rounds = 16;
+  static void *ptrs[batch];
+
+  okln("[kmalloc] benchmark: {} alloc/free pairs per size", batch * rounds);
+  for (const size_t size : sizes) {
+    InterruptDisabler disabler;
+
+    u64 start = read_tsc();
+    for (size_t round = 0; round < rounds; round++) {
+      for (size_t i = 0; i < batch; i++)
+        ptrs[i] = kmalloc(size);
+      for (size_t i = 0; i < batch; i++)
+        kfree(ptrs[i]);
+    }
+    const u32 slab_cycles = (u32)(read_tsc() - start);
+
+    start = read_tsc();
+    for (size_t round = 0; round < rounds; round++) {
+      for (size_t i = 0; i < batch; i++)
+        ptrs[i] = block_alloc(size, 0);
+      for (size_t i = 0; i < batch; i++) {
+        if (HeapSpan *span = block_free(block_for(ptrs[i])))
+          release_span(*span);
+      }
+    }
+    const u32 block_cycles = (u32)(read_tsc() - start);
+
+    okln("[kmalloc]   size {}: slab {} cycles/op, block {} cycles/op", size,
+         slab_cycles / (batch * rounds * 2),
+         block_cycles / (batch * rounds * 2));
+  }
+
+  // The same mixed-size churn through the public entry points under good fit
+  // and next fit, reporting how scattered the free space ends up and the
+  // longest time interrupts were kept off along the way.
+  static constexpr bool policies[] = {false, true};
+  const bool was_next_fit = g_kmalloc_next_fit;
+  for (const bool next_fit : policies) {
+    g_kmalloc_next_fit = next_fit;
+    kmalloc_reset_latency();
+    memset(ptrs, 0, sizeof(ptrs));
+    u32 seed = 0x1234;
+    const u64 start = read_tsc();
+    for (size_t op = 0; op < batch * rounds; op++) {
+      seed = seed * 1103515245 + 12345;
+      void *&ptr = ptrs[(seed >> 16) % batch];
+      if (ptr) {
+        kfree(ptr);
+        ptr = nullptr;
+      } else {
+        ptr = kmalloc(64 + (seed >> 8) % 4096);
+      }
+    }
+    const u32 cycles = (u32)(read_tsc() - start);
+    const u32 fragmentation = kmalloc_fragmentation();
+    for (size_t i = 0; i < batch; i++)
+      kfree(ptrs[i]);
+
+    KmallocStats stats;
+    kmalloc_get_stats(stats);
+    okln("[kmalloc]   {} churn: {} cycles/op, fragmentation {}/1000",
+         next_fit ? "next-fit" : "good-fit", cycles / (batch * rounds),
+         fragmentation);
+    okln("[kmalloc]   interrupts off for at most {} cycles (kmalloc), {} "
+         "(kfree)",
+         stats.kmalloc_max_cycles, stats.kfree_max_cycles);
+  }
+  g_kmalloc_next_fit = was_next_fit;
 }
+#endif
 
 void *operator new(size_t size) { return kmalloc(size); }
 void *operator new[](size_t size) { return kmalloc(size); }
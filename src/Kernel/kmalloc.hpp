@@ -11,6 +11,30 @@
 #define PAGE_SIZE 4096zu
 #define PAGE_MASK 0xfffff000
 
+// Physical memory the boot pool of the heap lives in.
+#define KMALLOC_POOL_BASE (3 * MB)
+#define KMALLOC_POOL_SIZE (1 * MB)
+
+// Virtual range the kernel heap grows into once the boot pool is exhausted.
+#define KMALLOC_GROW_BASE 0xc0000000
+#define KMALLOC_GROW_SIZE (64 * MB)
+
+#define KMALLOC_BENCHMARK 0
+
+// Fill every allocation with 0xbb and every freed block with 0xaa.
+#define KMALLOC_POISON 0
+
+// Sampled guard-page mode: one in g_kmalloc_guard_sample_rate allocations that
+// fit in a page is placed at the end of its own page, right in front of an
+// unmapped guard page. The page is unmapped again on kfree(), so overflows and
+// use-after-free on those objects fault and get reported with the stack that
+// allocated them.
+#define KMALLOC_GUARD_PAGES 0
+#define KMALLOC_GUARD_SAMPLE_RATE 128
+#define KMALLOC_GUARD_SLOTS 32
+#define KMALLOC_GUARD_BASE (KMALLOC_GROW_BASE + KMALLOC_GROW_SIZE)
+#define KMALLOC_GUARD_SIZE (KMALLOC_GUARD_SLOTS * 2 * PAGE_SIZE)
+
 void kmalloc_init();
 [[gnu::malloc, gnu::returns_nonnull, gnu::alloc_size(1)]] void *
 kmalloc_impl(size_t size);
@@ -21,12 +45,77 @@ kmalloc_aligned(size_t size, size_t alignment);
 void kfree(void *ptr);
 void kfree_aligned(void *ptr);
 
+// Resizes an allocation, in place when the heap has room right behind it.
+// Only kmalloc()'s own alignment is kept if the allocation has to move.
+[[gnu::alloc_size(2)]] void *krealloc(void *ptr, size_t size);
+
 bool is_kmalloc_address(const void *ptr);
 
+// Allocation sizes are counted in power of two buckets: bucket i holds sizes
+// up to 16 << i bytes. Free blocks are bucketed the same way, bucket i holding
+// blocks of at least 16 << i bytes.
+#define KMALLOC_SIZE_BUCKETS 16
+#define KMALLOC_RUN_BUCKETS 16
+
+// Longest time, in TSC cycles, a kmalloc()/kfree() may keep interrupts off.
+// kmalloc_dump_stats() complains if the measured worst case is above it.
+#define KMALLOC_LATENCY_BUDGET 20000
+
+struct KmallocStats {
+  size_t bytes_allocated;
+  size_t bytes_free;
+  size_t peak_allocated;
+  size_t largest_free_run;
+  u32 kmalloc_calls;
+  u32 kfree_calls;
+  u64 kmalloc_cycles; // spent with interrupts off
+  u64 kfree_cycles;
+  u32 kmalloc_max_cycles; // longest single stretch with interrupts off
+  u32 kfree_max_cycles;
+  u32 size_histogram[KMALLOC_SIZE_BUCKETS];
+  u32 free_runs[KMALLOC_RUN_BUCKETS];
+};
+
+// Takes a consistent snapshot of the heap counters with interrupts disabled.
+// The counters are kept up to date and only copied, except for the largest
+// free block: that walks the free list of the largest size class in use, so
+// the cost grows with the number of free blocks in that class.
+void kmalloc_get_stats(KmallocStats &stats);
+void kmalloc_dump_stats();
+
+// Starts measuring the worst-case interrupts-off time afresh.
+void kmalloc_reset_latency();
+
+// Block placement: by default a block comes from the smallest size class
+// that is sure to fit (good fit). With next fit, the free rest of the block
+// that was split last is used first, as long as it is large enough. Both take
+// constant time; kmalloc_benchmark() compares how much they fragment the heap.
+extern bool g_kmalloc_next_fit;
+
+// How scattered the free part of the heap is, in 1/1000: 0 means all free
+// memory is one block, values near 1000 mean no large block is left.
+u32 kmalloc_fragmentation();
+
+#if KMALLOC_BENCHMARK
+void kmalloc_benchmark();
+#endif
+
+#if KMALLOC_GUARD_PAGES
+void kmalloc_guard_init();
+bool kmalloc_guard_contains(u32 laddr);
+[[noreturn]] void kmalloc_guard_report_fault(u32 laddr, bool write);
+
+extern u32 g_kmalloc_guard_sample_rate;
+#endif
+
 extern volatile size_t sum_alloc, sum_free;
 extern u32 g_kmalloc_call_count;
 extern u32 g_kfree_call_count;
+
+// While set, every allocation is attributed to its call site;
+// kmalloc_dump_profile() prints the sites holding the most memory.
 extern bool g_dump_kmalloc_stacks;
+void kmalloc_dump_profile(size_t top = 16);
 
 inline void *operator new(size_t, void *ptr) { return ptr; }
 inline void *operator new[](size_t, void *ptr) { return ptr; }
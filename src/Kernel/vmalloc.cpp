@@ -0,0 +1,136 @@
+#include "vmalloc.hpp"
+#include "Interrupts/Interrupts.hpp"
+#include "MemoryManager.hpp"
+#include "kprintf.hpp"
+#include <LibCore/Defines.hpp>
+
+struct VmallocArea {
+  u32 base;
+  size_t length; // mapped bytes, not counting the guard page
+};
+
+// The areas sorted by address; there are few of them, so a free range is
+// found by walking the gaps between them.
+static VmallocArea s_areas[VMALLOC_AREAS];
+static size_t s_area_count;
+static size_t s_mapped_bytes, s_peak_mapped_bytes;
+static u32 s_vmalloc_calls, s_vmalloc_failures;
+
+static size_t area_index(const u32 base) {
+  size_t low = 0, high = s_area_count;
+  while (low < high) {
+    const size_t middle = (low + high) / 2;
+    if (s_areas[middle].base < base)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+static VmallocArea *area_for(const void *ptr) {
+  const size_t index = area_index((u32)ptr);
+  if (index == s_area_count || s_areas[index].base != (u32)ptr)
+    return nullptr;
+  return &s_areas[index];
+}
+
+static void remove_area(const size_t index) {
+  for (size_t i = index + 1; i < s_area_count; i++)
+    s_areas[i - 1] = s_areas[i];
+  s_area_count--;
+}
+
+// Reserves the range for an area with interrupts disabled; its pages are
+// then mapped one at a time with interrupts enabled in between, so the time
+// spent with them off does not grow with the size of the area.
+void *vmalloc(const size_t size) {
+  ASSERT(size);
+  const size_t length = (size + PAGE_SIZE - 1) & PAGE_MASK;
+  const size_t needed = length + PAGE_SIZE;
+
+  u32 base = VMALLOC_BASE;
+  {
+    InterruptDisabler disabler;
+    s_vmalloc_calls++;
+    if (s_area_count == VMALLOC_AREAS || needed > VMALLOC_SIZE) {
+      s_vmalloc_failures++;
+      return nullptr;
+    }
+
+    // First fit.
+    size_t index = 0;
+    for (; index < s_area_count; index++) {
+      if (s_areas[index].base - base >= needed)
+        break;
+      base = s_areas[index].base + s_areas[index].length + PAGE_SIZE;
+    }
+    if (index == s_area_count &&
+        VMALLOC_BASE + VMALLOC_SIZE - base < needed) {
+      s_vmalloc_failures++;
+      return nullptr;
+    }
+
+    for (size_t i = s_area_count; i > index; i--)
+      s_areas[i] = s_areas[i - 1];
+    s_areas[index] = {base, length};
+    s_area_count++;
+    s_mapped_bytes += length;
+    s_peak_mapped_bytes = max(s_peak_mapped_bytes, s_mapped_bytes);
+  }
+
+  for (size_t offset = 0; offset < length; offset += PAGE_SIZE) {
+    if (MM.map_kernel_range(LinearAddress(base + offset), PAGE_SIZE))
+      continue;
+    for (size_t undo = 0; undo < offset; undo += PAGE_SIZE)
+      MM.unmap_kernel_range(LinearAddress(base + undo), PAGE_SIZE);
+    InterruptDisabler disabler;
+    s_vmalloc_failures++;
+    s_mapped_bytes -= length;
+    remove_area(area_for((void *)base) - s_areas);
+    return nullptr;
+  }
+  return reinterpret_cast<void *>(base);
+}
+
+// The range stays reserved until its pages are unmapped, which happens one
+// page at a time like in vmalloc().
+void vfree(void *ptr) {
+  if (!ptr)
+    return;
+
+  size_t length;
+  {
+    InterruptDisabler disabler;
+    VmallocArea *area = area_for(ptr);
+    if (!area)
+      PANIC("vfree(): {:p} is not a vmalloc address", ptr);
+    length = area->length;
+  }
+  for (size_t offset = 0; offset < length; offset += PAGE_SIZE)
+    MM.unmap_kernel_range(LinearAddress((u32)ptr + offset), PAGE_SIZE);
+
+  InterruptDisabler disabler;
+  s_mapped_bytes -= length;
+  remove_area(area_for(ptr) - s_areas);
+}
+
+bool is_vmalloc_address(const void *ptr) {
+  const u32 addr = (u32)ptr;
+  return addr >= VMALLOC_BASE && addr - VMALLOC_BASE < VMALLOC_SIZE;
+}
+
+size_t vmalloc_size(const void *ptr) {
+  InterruptDisabler disabler;
+  VmallocArea *area = area_for(ptr);
+  ASSERT(area);
+  return area->length;
+}
+
+void vmalloc_dump_stats() {
+  InterruptDisabler disabler;
+  println("vmalloc: {} areas, {} bytes mapped (peak {}), {} of {} calls "
+          "failed",
+          s_area_count, s_mapped_bytes, s_peak_mapped_bytes,
+          s_vmalloc_failures, s_vmalloc_calls);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "kmalloc.hpp"
+#include <LibCore/Types.hpp>
+#include <LibCpp/cstddef.hpp>
+
+// Virtual range for large kernel buffers: every area is page aligned, built
+// from whatever frames are free and followed by an unmapped guard page. It
+// starts at the 4 MiB boundary after the heap's guard slots.
+#define VMALLOC_BASE (KMALLOC_GROW_BASE + KMALLOC_GROW_SIZE + 4 * MB)
+#define VMALLOC_SIZE (64 * MB)
+#define VMALLOC_AREAS 128
+
+// kmalloc() hands requests larger than this to vmalloc().
+#define VMALLOC_THRESHOLD (64 * KB)
+
+// Returns null if the range has no room left or memory is exhausted.
+void *vmalloc(size_t size);
+void vfree(void *ptr);
+
+bool is_vmalloc_address(const void *ptr);
+// Usable size of an area, i.e. the requested size rounded up to pages.
+size_t vmalloc_size(const void *ptr);
+
+void vmalloc_dump_stats();
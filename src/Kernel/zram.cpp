@@ -0,0 +1,186 @@
+#include "zram.hpp"
+#include "Interrupts/Interrupts.hpp"
+#include "MemoryManager.hpp"
+#include "kprintf.hpp"
+#include <LibC/string.h>
+#include <LibCore/Defines.hpp>
+#include <LibCore/LZ4.hpp>
+
+struct ZramObject {
+  u16 pool_page;
+  u16 offset;
+  u16 size; // compressed bytes, 0 while the slot is free
+};
+
+struct ZramPoolPage {
+  PhysicalAddress frame; // null while the entry is unused
+  u16 used;              // bytes appended so far
+  u16 objects;           // of those that are still stored
+};
+
+static ZramObject s_objects[ZRAM_SLOTS];
+static ZramPoolPage s_pool[ZRAM_POOL_PAGES];
+// The pool page new objects are appended to.
+static ZramPoolPage *s_open_page;
+static u8 s_buffer[ZRAM_MAX_OBJECT];
+static size_t s_slot_hint, s_pool_hint;
+static size_t s_stored, s_stored_bytes, s_pool_pages, s_peak_pool_pages;
+static u32 s_rejected, s_loads, s_faults;
+// Moving averages of the cycles it takes to decompress a page, and to handle
+// a page fault on a page in zram.
+static u32 s_load_cycles, s_fault_cycles;
+
+static u32 allocate_slot() {
+  for (size_t i = 0; i < ZRAM_SLOTS; i++) {
+    const size_t index = (s_slot_hint + i) % ZRAM_SLOTS;
+    if (!s_objects[index].size) {
+      s_slot_hint = index + 1;
+      return index + 1;
+    }
+  }
+  return 0;
+}
+
+static ZramPoolPage *add_pool_page(const PhysicalAddress frame) {
+  if (s_pool_pages == ZRAM_POOL_PAGES)
+    return nullptr;
+  for (size_t i = 0; i < ZRAM_POOL_PAGES; i++) {
+    ZramPoolPage &pool_page = s_pool[(s_pool_hint + i) % ZRAM_POOL_PAGES];
+    if (pool_page.frame.get())
+      continue;
+    pool_page = {frame, 0, 0};
+    s_pool_hint = &pool_page - s_pool + 1;
+    s_pool_pages++;
+    s_peak_pool_pages = max(s_peak_pool_pages, s_pool_pages);
+    return &pool_page;
+  }
+  return nullptr;
+}
+
+// Space freed in the middle of a pool page is only reused once the whole
+// page is empty, so this looks for room after the last object.
+static ZramPoolPage *pool_page_with_room(const size_t size) {
+  for (auto &pool_page : s_pool) {
+    if (pool_page.frame.get() && pool_page.used + size <= PAGE_SIZE)
+      return &pool_page;
+  }
+  return nullptr;
+}
+
+u32 zram_store(const PhysicalAddress page, bool &consumed) {
+  InterruptDisabler disabler;
+  consumed = false;
+  if (s_stored == ZRAM_SLOTS)
+    return 0;
+
+  u8 *ptr = MM.map_temporary(page);
+  const size_t size =
+      Core::LZ4::compress(ptr, PAGE_SIZE, s_buffer, sizeof(s_buffer));
+  MM.unmap_temporary(ptr);
+  if (!size) {
+    s_rejected++;
+    return 0;
+  }
+
+  // Without room in the open page or any other, the page being stored
+  // becomes pool storage; its contents are safe in the buffer by now.
+  // Whichever of the two has more room left stays open.
+  ZramPoolPage *pool_page = s_open_page;
+  if (!pool_page || pool_page->used + size > PAGE_SIZE)
+    pool_page = pool_page_with_room(size);
+  if (!pool_page) {
+    pool_page = add_pool_page(page);
+    if (!pool_page)
+      return 0;
+    consumed = true;
+    if (!s_open_page || s_open_page->used > size)
+      s_open_page = pool_page;
+  }
+
+  const u32 slot = allocate_slot();
+  ASSERT(slot);
+  ptr = MM.map_temporary(pool_page->frame);
+  memcpy(ptr + pool_page->used, s_buffer, size);
+  MM.unmap_temporary(ptr);
+  s_objects[slot - 1] = {(u16)(pool_page - s_pool), pool_page->used,
+                         (u16)size};
+  pool_page->used += size;
+  pool_page->objects++;
+  s_stored++;
+  s_stored_bytes += size;
+  return slot;
+}
+
+void zram_load(const u32 slot, const PhysicalAddress page) {
+  InterruptDisabler disabler;
+  ASSERT(slot && slot <= ZRAM_SLOTS);
+  const ZramObject object = s_objects[slot - 1];
+  ASSERT(object.size);
+
+  const u64 start = read_tsc();
+  const PhysicalAddress pages[] = {s_pool[object.pool_page].frame, page};
+  u8 *ptr = MM.map_temporary(pages, 2);
+  const isz size = Core::LZ4::decompress(ptr + object.offset, object.size,
+                                         ptr + PAGE_SIZE, PAGE_SIZE);
+  MM.unmap_temporary(ptr, 2);
+  if (size != PAGE_SIZE)
+    PANIC("zram: slot {} does not decompress to a page", slot);
+
+  const u32 cycles = (u32)(read_tsc() - start);
+  s_load_cycles = s_load_cycles ? (s_load_cycles * 7 + cycles) / 8 : cycles;
+  s_loads++;
+}
+
+void zram_count_fault(const u32 cycles) {
+  InterruptDisabler disabler;
+  s_fault_cycles = s_fault_cycles ? (s_fault_cycles * 7 + cycles) / 8 : cycles;
+  s_faults++;
+}
+
+void zram_free(const u32 slot) {
+  InterruptDisabler disabler;
+  ASSERT(slot && slot <= ZRAM_SLOTS);
+  ZramObject &object = s_objects[slot - 1];
+  ASSERT(object.size);
+  ZramPoolPage &pool_page = s_pool[object.pool_page];
+  s_stored--;
+  s_stored_bytes -= object.size;
+  object.size = 0;
+  if (--pool_page.objects)
+    return;
+
+  if (&pool_page == s_open_page) {
+    pool_page.used = 0;
+    return;
+  }
+  MM.free_physical_block(pool_page.frame, 0);
+  pool_page.frame = PhysicalAddress();
+  s_pool_pages--;
+}
+
+bool zram_is_full() {
+  InterruptDisabler disabler;
+  if (s_stored == ZRAM_SLOTS)
+    return true;
+  return s_pool_pages == ZRAM_POOL_PAGES &&
+         (!s_open_page || s_open_page->used > PAGE_SIZE - 64);
+}
+
+void zram_dump_stats() {
+  InterruptDisabler disabler;
+  // In tenths: the stored pages against their compressed size, and against
+  // the pool frames holding them.
+  const u32 ratio =
+      s_stored_bytes ? s_stored * PAGE_SIZE * 10 / s_stored_bytes : 0;
+  const u32 pool_ratio = s_pool_pages ? s_stored * 10 / s_pool_pages : 0;
+  println("[zram] {} pages stored in {} bytes, ratio {}.{}", s_stored,
+          s_stored_bytes, ratio / 10, ratio % 10);
+  println("[zram] pool: {} KiB ({} KiB peak), ratio {}.{} with slack",
+          s_pool_pages * 4, s_peak_pool_pages * 4, pool_ratio / 10,
+          pool_ratio % 10);
+  println("[zram] {} pages did not compress, {} loads, ~{} cycles to "
+          "decompress",
+          s_rejected, s_loads, s_load_cycles);
+  println("[zram] {} page faults, ~{} cycles per fault", s_faults,
+          s_fault_cycles);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "Common.hpp"
+#include <LibCore/Types.hpp>
+
+// Compressed swap in memory. Pages are LZ4 compressed into pool frames that
+// are filled front to back; a pool frame goes back to the page allocator once
+// everything stored in it has been freed.
+#define ZRAM_SLOTS 8192
+#define ZRAM_POOL_PAGES 2048
+// Pages that do not compress below this are left to the swap disk.
+#define ZRAM_MAX_OBJECT (PAGE_SIZE * 3 / 4)
+
+// Compresses `page` and returns the slot (from 1) it is stored in, or 0 if it
+// does not compress well enough or the pool is full. When the pool needs a
+// new frame it takes `page` itself and sets `consumed`; the caller must not
+// free it then.
+u32 zram_store(PhysicalAddress page, bool &consumed);
+// Decompresses the page in `slot` into `page`; the slot stays allocated.
+void zram_load(u32 slot, PhysicalAddress page);
+// Called by the page fault handler for every fault on a page in zram, with
+// the cycles it took to bring the page back and map it.
+void zram_count_fault(u32 cycles);
+void zram_free(u32 slot);
+
+// True if no page could be stored at the moment.
+bool zram_is_full();
+
+void zram_dump_stats();
@@ -69,7 +69,7 @@ namespace Core {
       return;
 
     const isz colon = fmt.find(':', open_brace + 1);
-    if (colon == -1) {
+    if (colon == -1 || colon > fmt.find('}', open_brace + 1)) {
       const isz close_brace = fmt.find('}', open_brace + 1);
       if (close_brace == -1)
         return;
@@ -0,0 +1,226 @@
+#pragma once
+
+#include "LibCore/Defines.hpp"
+#include <LibCpp/cstddef.hpp>
+
+// The links of one InlineAVLTree; a type that is kept in several trees at
+// once embeds one of these for each of them.
+template <typename T> struct InlineAVLTreeNode {
+  T *left = nullptr, *right = nullptr, *parent = nullptr;
+  int height = 0;
+};
+
+// Intrusive AVL tree. `Traits::node(T &)` returns the links an element uses
+// for this tree and `Traits::less(a, b)` orders elements, no two of which may
+// compare equal. The tree never owns its elements.
+template <typename T, typename Traits> class InlineAVLTree {
+public:
+  InlineAVLTree() = default;
+
+  bool is_empty() const { return !m_root; }
+  size_t size() const { return m_size; }
+
+  void insert(T &item) {
+    auto &links = Traits::node(item);
+    ASSERT(!links.height);
+    links.left = links.right = links.parent = nullptr;
+    links.height = 1;
+    m_root = insert(m_root, item);
+    Traits::node(*m_root).parent = nullptr;
+    m_size++;
+  }
+
+  void remove(T &item) {
+    ASSERT(Traits::node(item).height);
+    m_root = remove(m_root, item);
+    if (m_root)
+      Traits::node(*m_root).parent = nullptr;
+    Traits::node(item) = {};
+    m_size--;
+  }
+
+  T *first() const { return m_root ? leftmost(*m_root) : nullptr; }
+  T *last() const { return m_root ? rightmost(*m_root) : nullptr; }
+
+  static T *next(T &item) {
+    if (T *right = Traits::node(item).right)
+      return leftmost(*right);
+    T *child = &item;
+    T *parent = Traits::node(item).parent;
+    while (parent && Traits::node(*parent).right == child) {
+      child = parent;
+      parent = Traits::node(*parent).parent;
+    }
+    return parent;
+  }
+
+  static T *prev(T &item) {
+    if (T *left = Traits::node(item).left)
+      return rightmost(*left);
+    T *child = &item;
+    T *parent = Traits::node(item).parent;
+    while (parent && Traits::node(*parent).left == child) {
+      child = parent;
+      parent = Traits::node(*parent).parent;
+    }
+    return parent;
+  }
+
+  // The first element for which `predicate` holds, given that it holds for
+  // every element after that one as well.
+  template <typename Predicate> T *first_where(Predicate predicate) const {
+    T *found = nullptr;
+    for (T *node = m_root; node;) {
+      if (predicate(*node)) {
+        found = node;
+        node = Traits::node(*node).left;
+      } else {
+        node = Traits::node(*node).right;
+      }
+    }
+    return found;
+  }
+
+  // The last element for which `predicate` holds, given that it holds for
+  // every element before that one as well.
+  template <typename Predicate> T *last_where(Predicate predicate) const {
+    T *found = nullptr;
+    for (T *node = m_root; node;) {
+      if (predicate(*node)) {
+        found = node;
+        node = Traits::node(*node).right;
+      } else {
+        node = Traits::node(*node).left;
+      }
+    }
+    return found;
+  }
+
+  class Iterator {
+  public:
+    explicit Iterator(T *node) : m_node(node) {}
+    bool operator!=(const Iterator &other) const {
+      return m_node != other.m_node;
+    }
+    Iterator &operator++() {
+      m_node = next(*m_node);
+      return *this;
+    }
+    T *operator*() const { return m_node; }
+
+  private:
+    T *m_node;
+  };
+
+  Iterator begin() const { return Iterator(first()); }
+  Iterator end() const { return Iterator(nullptr); }
+
+private:
+  static T *leftmost(T &item) {
+    T *node = &item;
+    while (Traits::node(*node).left)
+      node = Traits::node(*node).left;
+    return node;
+  }
+
+  static T *rightmost(T &item) {
+    T *node = &item;
+    while (Traits::node(*node).right)
+      node = Traits::node(*node).right;
+    return node;
+  }
+
+  static int height(const T *node) {
+    return node ? Traits::node(*const_cast<T *>(node)).height : 0;
+  }
+
+  // Recomputes the height of `node` and points its children back at it.
+  static void update(T &node) {
+    auto &links = Traits::node(node);
+    links.height = 1 + max(height(links.left), height(links.right));
+    if (links.left)
+      Traits::node(*links.left).parent = &node;
+    if (links.right)
+      Traits::node(*links.right).parent = &node;
+  }
+
+  static T *rotate_left(T &node) {
+    T &right = *Traits::node(node).right;
+    Traits::node(node).right = Traits::node(right).left;
+    update(node);
+    Traits::node(right).left = &node;
+    update(right);
+    return &right;
+  }
+
+  static T *rotate_right(T &node) {
+    T &left = *Traits::node(node).left;
+    Traits::node(node).left = Traits::node(left).right;
+    update(node);
+    Traits::node(left).right = &node;
+    update(left);
+    return &left;
+  }
+
+  static T *balance(T &node) {
+    update(node);
+    auto &links = Traits::node(node);
+    const int factor = height(links.left) - height(links.right);
+    if (factor > 1) {
+      auto &left = Traits::node(*links.left);
+      if (height(left.left) < height(left.right))
+        links.left = rotate_left(*links.left);
+      return rotate_right(node);
+    }
+    if (factor < -1) {
+      auto &right = Traits::node(*links.right);
+      if (height(right.right) < height(right.left))
+        links.right = rotate_right(*links.right);
+      return rotate_left(node);
+    }
+    return &node;
+  }
+
+  static T *insert(T *root, T &item) {
+    if (!root)
+      return &item;
+    auto &links = Traits::node(*root);
+    if (Traits::less(item, *root))
+      links.left = insert(links.left, item);
+    else
+      links.right = insert(links.right, item);
+    return balance(*root);
+  }
+
+  static T *remove_leftmost(T &root, T *&leftmost) {
+    auto &links = Traits::node(root);
+    if (!links.left) {
+      leftmost = &root;
+      return links.right;
+    }
+    links.left = remove_leftmost(*links.left, leftmost);
+    return balance(root);
+  }
+
+  static T *remove(T *root, T &item) {
+    ASSERT(root);
+    auto &links = Traits::node(*root);
+    if (root == &item) {
+      if (!links.right)
+        return links.left;
+      T *successor;
+      T *right = remove_leftmost(*links.right, successor);
+      Traits::node(*successor).left = links.left;
+      Traits::node(*successor).right = right;
+      return balance(*successor);
+    }
+    if (Traits::less(item, *root))
+      links.left = remove(links.left, item);
+    else
+      links.right = remove(links.right, item);
+    return balance(*root);
+  }
+
+  T *m_root = nullptr;
+  size_t m_size = 0;
+};
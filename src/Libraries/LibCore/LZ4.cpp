@@ -0,0 +1,154 @@
+#include "LZ4.hpp"
+#include "Defines.hpp"
+#include <LibC/string.h>
+
+namespace Core::LZ4 {
+
+  static constexpr usz MIN_MATCH = 4;
+  // The format requires the last 5 bytes to be literals and the last match
+  // to start at least 12 bytes before the end.
+  static constexpr usz LAST_LITERALS = 5;
+  static constexpr usz MATCH_LIMIT = 12;
+  static constexpr usz HASH_LOG = 10;
+
+  static u32 read32(const u8 *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24;
+  }
+
+  static u32 hash(const u32 sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_LOG);
+  }
+
+  static u8 *write_length(u8 *out, usz length) {
+    for (; length >= 255; length -= 255)
+      *out++ = 255;
+    *out++ = length;
+    return out;
+  }
+
+  // Emits one sequence; `match_length` is 0 for the final literals. Returns
+  // null if the output would overflow.
+  static u8 *emit(u8 *out, const u8 *out_end, const u8 *literals,
+                  const usz literal_count, const u16 offset,
+                  const usz match_length) {
+    const usz needed = 1 + literal_count + literal_count / 255 + 1 +
+                       (match_length ? 2 + match_length / 255 + 1 : 0);
+    if (needed > (usz)(out_end - out))
+      return nullptr;
+
+    u8 *token = out++;
+    if (literal_count >= 15) {
+      *token = 15 << 4;
+      out = write_length(out, literal_count - 15);
+    } else {
+      *token = literal_count << 4;
+    }
+    memcpy(out, literals, literal_count);
+    out += literal_count;
+    if (!match_length)
+      return out;
+
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+    const usz length = match_length - MIN_MATCH;
+    if (length >= 15) {
+      *token |= 15;
+      out = write_length(out, length - 15);
+    } else {
+      *token |= length;
+    }
+    return out;
+  }
+
+  usz compress(const u8 *src, const usz size, u8 *dest, const usz capacity) {
+    ASSERT(size <= MAX_INPUT);
+    u16 table[1 << HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    const u8 *const end = src + size;
+    const u8 *const out_end = dest + capacity;
+    const u8 *anchor = src;
+    u8 *out = dest;
+    if (size > MATCH_LIMIT) {
+      const u8 *const match_start_limit = end - MATCH_LIMIT;
+      const u8 *const match_end_limit = end - LAST_LITERALS;
+      for (const u8 *ip = src; ip < match_start_limit;) {
+        const u32 sequence = read32(ip);
+        const u32 h = hash(sequence);
+        const u8 *ref = src + table[h];
+        table[h] = ip - src;
+        if (ref >= ip || read32(ref) != sequence) {
+          ip++;
+          continue;
+        }
+
+        usz length = MIN_MATCH;
+        while (ip + length < match_end_limit && ip[length] == ref[length])
+          length++;
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+          ip--;
+          ref--;
+          length++;
+        }
+        out = emit(out, out_end, anchor, ip - anchor, ip - ref, length);
+        if (!out)
+          return 0;
+        ip += length;
+        anchor = ip;
+      }
+    }
+    out = emit(out, out_end, anchor, end - anchor, 0, 0);
+    return out ? out - dest : 0;
+  }
+
+  static bool read_length(const u8 *&in, const u8 *in_end, usz &length) {
+    u8 byte;
+    do {
+      if (in == in_end)
+        return false;
+      byte = *in++;
+      length += byte;
+    } while (byte == 255);
+    return true;
+  }
+
+  isz decompress(const u8 *src, const usz size, u8 *dest, const usz capacity) {
+    const u8 *in = src;
+    const u8 *const in_end = src + size;
+    u8 *out = dest;
+    const u8 *const out_end = dest + capacity;
+    while (in < in_end) {
+      const u8 token = *in++;
+      usz literals = token >> 4;
+      if (literals == 15 && !read_length(in, in_end, literals))
+        return -1;
+      if (literals > (usz)(in_end - in) || literals > (usz)(out_end - out))
+        return -1;
+      memcpy(out, in, literals);
+      in += literals;
+      out += literals;
+      if (in == in_end)
+        break;
+
+      if (in_end - in < 2)
+        return -1;
+      const usz offset = in[0] | in[1] << 8;
+      in += 2;
+      if (!offset || offset > (usz)(out - dest))
+        return -1;
+      usz length = token & 15;
+      if (length == 15 && !read_length(in, in_end, length))
+        return -1;
+      length += MIN_MATCH;
+      if (length > (usz)(out_end - out))
+        return -1;
+      // Byte by byte: the match may overlap the bytes it produces.
+      const u8 *match = out - offset;
+      for (usz i = 0; i < length; i++)
+        out[i] = match[i];
+      out += length;
+    }
+    return out - dest;
+  }
+
+} // namespace Core::LZ4
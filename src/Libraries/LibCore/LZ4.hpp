@@ -0,0 +1,27 @@
+#pragma once
+
+#include "Types.hpp"
+
+// LZ4 block format: a sequence is a token (literal count in the high nibble,
+// match length - 4 in the low one; 15 means more length bytes follow), the
+// literals, and a 16 bit little endian offset back into the output. The last
+// sequence is literals only.
+namespace Core::LZ4 {
+
+  // Inputs are limited to 64 KiB, so a 16 bit offset can reach all of them.
+  constexpr usz MAX_INPUT = 65535;
+
+  // The compressed size of `size` incompressible bytes.
+  constexpr usz compress_bound(const usz size) {
+    return size + size / 255 + 16;
+  }
+
+  // Returns the compressed size, or 0 if the result does not fit in
+  // `capacity` bytes.
+  usz compress(const u8 *src, usz size, u8 *dest, usz capacity);
+
+  // Returns the decompressed size, or -1 if the input is malformed or does
+  // not decompress into `capacity` bytes.
+  isz decompress(const u8 *src, usz size, u8 *dest, usz capacity);
+
+} // namespace Core::LZ4
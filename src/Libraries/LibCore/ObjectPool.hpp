@@ -0,0 +1,117 @@
+#pragma once
+
+#include "Defines.hpp"
+#include "Types.hpp"
+
+#include "../../Kernel/kmalloc.hpp"
+
+namespace Core {
+
+  struct NullLock {};
+
+  struct ObjectPoolStats {
+    u32 allocations; // calls to allocate()
+    u32 hits;        // allocations served without refilling
+    u32 refills;     // batches taken from kmalloc()
+    u32 frees;
+    u32 cache_hits; // take_cached() calls that returned an object
+    usz capacity;   // slots owned by the pool
+    usz in_use;
+
+    // Share of allocations served straight from the free list, in percent.
+    u32 hit_rate() const { return allocations ? hits * 100 / allocations : 0; }
+  };
+
+  // Hands out storage for objects of one type from a per-type free list, so
+  // that frequently created and destroyed objects do not go through the
+  // general purpose heap every time. Storage is taken from kmalloc() in
+  // batches of `batch_size` slots and is kept by the pool once it was
+  // handed out.
+  //
+  // If `cache_size` is non-zero, up to that many objects can additionally be
+  // parked fully constructed with cache() and picked up again with
+  // take_cached(), skipping both destruction and construction.
+  //
+  // A `Lock` object is held while the pool is modified; kernel users pass
+  // InterruptDisabler.
+  template <typename T, typename Lock = NullLock, usz batch_size = 8,
+            usz cache_size = 0>
+  class ObjectPool {
+  public:
+    void *allocate() {
+      [[maybe_unused]] Lock lock;
+      m_stats.allocations++;
+      if (m_free_list)
+        m_stats.hits++;
+      else
+        refill();
+
+      FreeSlot *slot = m_free_list;
+      m_free_list = slot->next;
+      m_stats.in_use++;
+      return slot;
+    }
+
+    void deallocate(void *ptr) {
+      if (!ptr)
+        return;
+      [[maybe_unused]] Lock lock;
+      auto *slot = static_cast<FreeSlot *>(ptr);
+      slot->next = m_free_list;
+      m_free_list = slot;
+      m_stats.frees++;
+      m_stats.in_use--;
+    }
+
+    T *take_cached() {
+      [[maybe_unused]] Lock lock;
+      if (!m_cached_count)
+        return nullptr;
+      m_stats.cache_hits++;
+      return m_cached[--m_cached_count];
+    }
+
+    // Returns false if the cache is full; the caller has to destroy the
+    // object itself then.
+    bool cache(T *object) {
+      [[maybe_unused]] Lock lock;
+      if (m_cached_count == cache_size)
+        return false;
+      m_cached[m_cached_count++] = object;
+      return true;
+    }
+
+    ObjectPoolStats stats() const {
+      [[maybe_unused]] Lock lock;
+      return m_stats;
+    }
+
+  private:
+    struct FreeSlot {
+      FreeSlot *next;
+    };
+
+    union Slot {
+      FreeSlot free;
+      alignas(T) u8 storage[sizeof(T)];
+    };
+
+    void refill() {
+      auto *slots = static_cast<Slot *>(kmalloc(sizeof(Slot) * batch_size));
+      for (usz i = batch_size; i > 0; i--) {
+        slots[i - 1].free.next = m_free_list;
+        m_free_list = &slots[i - 1].free;
+      }
+      m_stats.refills++;
+      m_stats.capacity += batch_size;
+    }
+
+    FreeSlot *m_free_list = nullptr;
+    ObjectPoolStats m_stats{};
+    T *m_cached[cache_size ? cache_size : 1] = {};
+    usz m_cached_count = 0;
+  };
+
+} // namespace Core
+
+using Core::ObjectPool;
@@ -81,6 +81,8 @@ namespace Core {
     T *m_ptr = nullptr;
   };
 
+  template <typename T> struct IsTriviallyRelocatable<OwnPtr<T>> : TrueType {};
+
   template <typename T, typename... Args> OwnPtr<T> make(Args &&...args) {
     return OwnPtr<T>(new T(forward<Args>(args)...));
   }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Trait.hpp"
 #include <LibCpp/cstddef.hpp>
 
 namespace Core {
@@ -111,6 +112,9 @@ namespace Core {
     T *m_ptr = nullptr;
   };
 
+  template <typename T>
+  struct IsTriviallyRelocatable<RetainPtr<T>> : TrueType {};
+
   template <typename T> inline RetainPtr<T> adopt(T &object) {
     return RetainPtr<T>(RetainPtr<T>::Adopt, object);
   }
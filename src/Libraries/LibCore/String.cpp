@@ -29,20 +29,21 @@ namespace Core {
     return {m_string + start, end - start};
   }
 
+  void StringBuilder::ensure_capacity(const usz capacity) {
+    if (capacity <= m_capacity)
+      return;
+    usz new_capacity = m_capacity * 2;
+    if (new_capacity < capacity) {
+      new_capacity = capacity;
+    }
+
+    m_string = (char *)krealloc(m_string, new_capacity);
+    m_capacity = new_capacity;
+  }
+
   StringBuilder &StringBuilder::append(const char *string, const usz size) {
     ASSERT(size <= m_capacity);
-    if (m_size + size > m_capacity) {
-      usz new_capacity = m_capacity * 2;
-      if (new_capacity < m_size + size) {
-        new_capacity = m_size + size;
-      }
-
-      const auto new_string = new char[new_capacity];
-      memcpy(new_string, m_string, m_size);
-      delete[] m_string;
-      m_string = new_string;
-      m_capacity = new_capacity;
-    }
+    ensure_capacity(m_size + size + 1);
 
     memcpy(m_string + m_size, string, size + 1);
     m_size += size;
@@ -60,18 +61,7 @@ namespace Core {
   }
 
   StringBuilder &StringBuilder::append(const char character) {
-    if (m_size + 1 > m_capacity) {
-      usz new_capacity = m_capacity * 2;
-      if (new_capacity < m_size + 1) {
-        new_capacity = m_size + 1;
-      }
-
-      const auto new_string = new char[new_capacity];
-      memcpy(new_string, m_string, m_size);
-      delete[] m_string;
-      m_string = new_string;
-      m_capacity = new_capacity;
-    }
+    ensure_capacity(m_size + 2);
 
     m_string[m_size++] = character;
     m_string[m_size] = '\0'; // TODO: This is probably not necessary
@@ -85,6 +85,8 @@ namespace Core {
     [[nodiscard]] String build() const { return {m_string, m_size}; }
 
   private:
+    void ensure_capacity(usz capacity);
+
     char *m_string;
     usz m_size, m_capacity = 0;
   };
@@ -263,6 +263,12 @@ namespace Core {
   template <class Ret, class... Args>
   struct IsFunction<Ret(Args......) const volatile &&> : TrueType {};
 
+  // Objects that can be moved to another address with a plain memcpy, leaving
+  // nothing behind that needs to be destroyed.
+  template <class T>
+  struct IsTriviallyRelocatable
+      : IntegralConstant<bool, __is_trivially_copyable(T)> {};
+
   template <class T>
   struct IsRvalueReference : FalseType {};
   template <class T>
@@ -19,6 +19,7 @@ using usz = __SIZE_TYPE__;
 
 extern "C" void *kmalloc(usz);
 extern "C" void kfree(void *);
+extern "C" void *krealloc(void *, usz);
 
 using uid_t = u32;
 using gid_t = u32;
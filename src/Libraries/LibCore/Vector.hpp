@@ -136,6 +136,16 @@ namespace Core {
       if (capacity() >= neededCapacity)
         return;
       usz newCapacity = padded_capacity(neededCapacity);
+      if constexpr (IsTriviallyRelocatable<T>::value) {
+        // The elements can simply be moved along with the buffer, which the
+        // heap may be able to grow where it is.
+        if (m_impl) {
+          usz size = sizeof(VectorImpl<T>) + sizeof(T) * newCapacity;
+          m_impl = (VectorImpl<T> *)krealloc(m_impl, size);
+          m_impl->m_capacity = newCapacity;
+          return;
+        }
+      }
       auto newImpl = VectorImpl<T>::create(newCapacity);
       if (m_impl) {
         newImpl->m_size = m_impl->m_size;